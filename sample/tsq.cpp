@@ -31,27 +31,58 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
 #include <time.h>
 
 
 #include "../turbosqueeze.h"
 
 
-void compress( const char* infilename, const char* outfilename, uint32_t compression_level )
+/*
+** Whole file in memory, for the dictionaries and the training samples
+*/
+bool load( const char* filename, std::vector<char>& data )
 {
+    FILE* file = fopen( filename, "rb" );
+    if (file == nullptr)
+    {
+        printf( "Can't open %s\n", filename );
+        return false;
+    }
+
+    fseek( file, 0, SEEK_END );
+    data.resize( ftell( file ) );
+    fseek( file, 0, SEEK_SET );
+
+    bool ok = fread( data.data(), 1, data.size(), file ) == data.size();
+    fclose( file );
+
+    return ok;
+}
+
+
+void compress( const char* infilename, const char* outfilename, uint32_t compression_level, uint32_t n_threads, uint32_t block_bits, bool linked, const char* dictfilename )
+{
+    std::vector<char> dictionary;
+    if (dictfilename && !load( dictfilename, dictionary )) return;
+
     clock_t start = clock();
 
-    auto compression_ctx = TurboSqueeze::CompressorFactory( compression_level );
-    auto file_reader = TurboSqueeze::FileReaderFactory( infilename );
+    auto compression_ctx = TurboSqueeze::CompressorFactory( compression_level, n_threads, block_bits, linked );
+    compression_ctx->setDictionary( (const uint8_t*) dictionary.data(), dictionary.size() );
+    auto file_reader = TurboSqueeze::MappedFileReaderFactory( infilename );
     auto file_writer = TurboSqueeze::FileWriterFactory( outfilename );
 
     compression_ctx->compress( file_reader, file_writer );
+    file_writer->close();
 
-    printf("%s (%zu) -> %s (%zu) in %.3fs\n", infilename, file_reader->getpos(), outfilename, file_writer->getpos(), double(clock()-start) / CLOCKS_PER_SEC );
+    if (file_writer->isFailed())
+        printf( "Can't write %s\n", outfilename );
+    else
+        printf("%s (%zu) -> %s (%zu) in %.3fs\n", infilename, file_reader->getpos(), outfilename, file_writer->getpos(), double(clock()-start) / CLOCKS_PER_SEC );
 
     TurboSqueeze::WriterDestroy( file_writer );
     TurboSqueeze::ReaderDestroy( file_reader );
@@ -59,17 +90,25 @@ void compress( const char* infilename, const char* outfilename, uint32_t compres
 }
 
 
-void decompress( const char* infilename, const char* outfilename )
+void decompress( const char* infilename, const char* outfilename, uint32_t n_threads, bool interleaved, const char* dictfilename )
 {
+    std::vector<char> dictionary;
+    if (dictfilename && !load( dictfilename, dictionary )) return;
+
     clock_t start = clock();
 
-    auto decompression_ctx = TurboSqueeze::DecompressorFactory();
-    auto file_reader = TurboSqueeze::FileReaderFactory( infilename );
+    auto decompression_ctx = TurboSqueeze::DecompressorFactory( n_threads, interleaved );
+    decompression_ctx->setDictionary( (const uint8_t*) dictionary.data(), dictionary.size() );
+    auto file_reader = TurboSqueeze::MappedFileReaderFactory( infilename );
     auto file_writer = TurboSqueeze::FileWriterFactory( outfilename );
 
     decompression_ctx->decompress( file_reader, file_writer );
+    file_writer->close();
 
-    printf("%s (%zu) -> %s (%zu) in %.3fs\n", infilename, file_reader->getpos(), outfilename, file_writer->getpos(), double(clock()-start) / CLOCKS_PER_SEC );
+    if (file_writer->isFailed())
+        printf( "Can't write %s\n", outfilename );
+    else
+        printf("%s (%zu) -> %s (%zu) in %.3fs\n", infilename, file_reader->getpos(), outfilename, file_writer->getpos(), double(clock()-start) / CLOCKS_PER_SEC );
 
     TurboSqueeze::WriterDestroy( file_writer );
     TurboSqueeze::ReaderDestroy( file_reader );
@@ -77,21 +116,73 @@ void decompress( const char* infilename, const char* outfilename )
 }
 
 
+/*
+** Dictionary training: every line of the sample files is a sample, files without new lines are one sample
+*/
+void train( const char* dictfilename, uint32_t dictsize, int nfiles, const char** samplefilenames )
+{
+    std::vector<char> samples;
+    std::vector<size_t> sizes;
+
+    for (int f=0; f<nfiles; f++)
+    {
+        std::vector<char> data;
+        if (!load( samplefilenames[f], data )) return;
+
+        size_t begin = 0;
+        for (size_t i=0; i<data.size(); i++)
+        {
+            if (data[i] == '\n' || i+1 == data.size())
+            {
+                sizes.push_back( i+1-begin );
+                begin = i+1;
+            }
+        }
+
+        samples.insert( samples.end(), data.begin(), data.end() );
+    }
+
+    std::vector<char> dictionary( dictsize );
+    dictionary.resize( TurboSqueeze::trainDictionary( samples.data(), sizes.data(), sizes.size(), dictionary.data(), dictionary.size() ) );
+
+    FILE* file = fopen( dictfilename, "wb" );
+    if (file == nullptr || fwrite( dictionary.data(), 1, dictionary.size(), file ) != dictionary.size())
+        printf( "Can't write %s\n", dictfilename );
+    else
+        printf( "%zu samples (%zu) -> %s (%zu)\n", sizes.size(), samples.size(), dictfilename, dictionary.size() );
+
+    if (file) fclose( file );
+}
+
+
+/*
+** Compares the decoded bytes with the source, the test modes exit with 1 on a mismatch
+*/
+bool verify( const char* what, const uint8_t* input, const uint8_t* decompressed, size_t size )
+{
+    if (memcmp( input, decompressed, size ) == 0) return true;
+
+    printf("%s FAILED: the decompressed data differs from the source\n", what);
+    return false;
+}
+
+
 /*
 ** Test cases: Compress memory to memory, decompress memory to memory. Used as a benchmark because we have no file IO overhead.
 */
-void test()
+bool test()
 {
     const uint32_t testsize = 1<<30;
+    const size_t outputsize = TurboSqueeze::compressBound( testsize );
 
     uint8_t* testinput = new uint8_t [testsize];
-    uint8_t* testoutput = new uint8_t [testsize+testsize/4];
+    uint8_t* testoutput = new uint8_t [outputsize];
     uint8_t* testdecompressed = new uint8_t [testsize];
 
     if (testinput == nullptr || testoutput == nullptr || testdecompressed == nullptr)
     {
     	printf( "Sorry, your system doesn't have enough memory to run the test/benchmark mode (%uMB required)\n", 3*(testsize>>20)+(testsize>>22) );
-    	return;
+    	return false;
     }
 
     for (uint32_t i=0; i<testsize; i++)
@@ -100,7 +191,7 @@ void test()
     // Compress at level 0
     auto compression_ctx = TurboSqueeze::CompressorFactory( 0 );
     auto memory_reader = TurboSqueeze::MemoryReaderFactory( (char*) testinput, testsize );
-    auto memory_writer = TurboSqueeze::MemoryWriterFactory( (char*) testoutput, testsize+testsize/4 );
+    auto memory_writer = TurboSqueeze::MemoryWriterFactory( (char*) testoutput, outputsize );
 
     clock_t start = clock();
 
@@ -121,7 +212,7 @@ void test()
     // Compress at level 2
     compression_ctx = TurboSqueeze::CompressorFactory( 2 );
     memory_reader = TurboSqueeze::MemoryReaderFactory( (char*) testinput, testsize );
-    memory_writer = TurboSqueeze::MemoryWriterFactory( (char*) testoutput, testsize+testsize/4 );
+    memory_writer = TurboSqueeze::MemoryWriterFactory( (char*) testoutput, outputsize );
 
     start = clock();
 
@@ -158,21 +249,82 @@ void test()
     decompression_ctx = nullptr;
 
     // Verify that the decompressed data is identical to the source
-    for (uint32_t i=0; i<testsize; i++)
+    bool ok = verify( "Decompression", testinput, testdecompressed, testsize );
+
+    // Decompress with the multi-stream kernel, over a cleared buffer so a decoder writing nothing fails
+    memset( testdecompressed, 0, testsize );
+    decompression_ctx = TurboSqueeze::DecompressorFactory( 1, true );
+    memory_reader = TurboSqueeze::MemoryReaderFactory( (char*) testoutput, compressed_size );
+    memory_writer = TurboSqueeze::MemoryWriterFactory( (char*) testdecompressed, testsize );
+
+    start = clock();
+
+    decompression_ctx->decompress( memory_reader, memory_writer );
+
+    seconds = double(clock()-start) / CLOCKS_PER_SEC;
+    printf("Interleaved decompression in %.3fs (%.3fMB/s)\n", seconds, testsize*0.000001/seconds );
+    TurboSqueeze::WriterDestroy( memory_writer );
+    memory_writer = nullptr;
+    TurboSqueeze::ReaderDestroy( memory_reader );
+    memory_reader = nullptr;
+    TurboSqueeze::DecompressorDestroy( decompression_ctx );
+    decompression_ctx = nullptr;
+
+    ok = verify( "Interleaved decompression", testinput, testdecompressed, testsize ) && ok;
+
+    // One-shot API on 4KB records with reused contexts
+    const uint32_t recordsize = 4096;
+    compression_ctx = TurboSqueeze::CompressorFactory( 0 );
+    decompression_ctx = TurboSqueeze::DecompressorFactory();
+
+    start = clock();
+
+    uint32_t* record_sizes = new uint32_t [testsize/recordsize];
+
+    compressed_size = 0;
+    for (uint32_t i=0; i<testsize; i+=recordsize)
+    {
+        record_sizes[i/recordsize] = TurboSqueeze::compress( compression_ctx, (char*) testinput+i, recordsize, (char*) testoutput+compressed_size, outputsize-compressed_size );
+        compressed_size += record_sizes[i/recordsize];
+    }
+
+    seconds = double(clock()-start) / CLOCKS_PER_SEC;
+    printf("One-shot compression level 0 of %u byte records in %.3fs (%.3fMB/s)\n", recordsize, seconds, testsize*0.000001/seconds );
+
+    memset( testdecompressed, 0, testsize );
+
+    start = clock();
+
+    size_t pos = 0;
+    for (uint32_t i=0; i<testsize; i+=recordsize)
     {
-    	assert( testinput[i] == testdecompressed[i] );
+        TurboSqueeze::decompress( decompression_ctx, (char*) testoutput+pos, record_sizes[i/recordsize], (char*) testdecompressed+i, recordsize );
+        pos += record_sizes[i/recordsize];
     }
 
+    seconds = double(clock()-start) / CLOCKS_PER_SEC;
+    printf("One-shot decompression of %u byte records in %.3fs (%.3fMB/s)\n", recordsize, seconds, testsize*0.000001/seconds );
+
+    ok = verify( "One-shot decompression", testinput, testdecompressed, testsize ) && ok;
+
+    TurboSqueeze::CompressorDestroy( compression_ctx );
+    compression_ctx = nullptr;
+    TurboSqueeze::DecompressorDestroy( decompression_ctx );
+    decompression_ctx = nullptr;
+
+    delete [] record_sizes;
     delete [] testdecompressed;
     delete [] testoutput;
     delete [] testinput;
+
+    return ok;
 }
 
 
 /*
 ** Test cases: Compress memory to file, decompress file to memory
 */
-void testfile()
+bool testfile()
 {
     const uint32_t testsize = 1<<24;
 
@@ -182,7 +334,7 @@ void testfile()
     if (testinput == nullptr || testdecompressed == nullptr)
     {
     	printf( "Sorry, your system doesn't have enough memory to run the test mode (%uMB required)\n", 2*(testsize>>20) );
-    	return;
+    	return false;
     }
 
     for (uint32_t i=0; i<testsize; i++)
@@ -228,38 +380,323 @@ void testfile()
     decompression_ctx = nullptr;
 
     // Verify that the decompressed data is identical to the source
-    for (uint32_t i=0; i<testsize; i++)
-    {
-    	assert( testinput[i] == testdecompressed[i] );
-    }
+    bool ok = verify( "File decompression", testinput, testdecompressed, testsize );
 
     delete [] testdecompressed;
     delete [] testinput;
 
     remove( "smousse.tsq" );
+
+    return ok;
+}
+
+
+/*
+** Test case: zero pages at the ultra level, whose runs are carried over by the optimal parse instead of being extended
+** again at every position. Fails when the round trip differs or takes too long.
+*/
+bool testzeros()
+{
+    const uint32_t testsize = 1<<24;
+
+    std::vector<char> testinput( testsize, 0 );
+    std::vector<char> testoutput( TurboSqueeze::compressBound( testsize ) );
+    std::vector<char> testdecompressed( testsize );
+
+    auto compression_ctx = TurboSqueeze::CompressorFactory( TurboSqueeze::ULTRA_LEVEL, 1, TurboSqueeze::MAX_BLOCK_BITS );
+
+    clock_t start = clock();
+
+    size_t compressed_size = TurboSqueeze::compress( compression_ctx, testinput.data(), testsize, testoutput.data(), testoutput.size() );
+
+    double seconds = double(clock()-start) / CLOCKS_PER_SEC;
+    printf("Compression level %u of zeros in %.3fs (%.3fMB/s)\n", TurboSqueeze::ULTRA_LEVEL, seconds, testsize*0.000001/seconds );
+
+    TurboSqueeze::CompressorDestroy( compression_ctx );
+
+    size_t decompressed_size = TurboSqueeze::decompress( testoutput.data(), compressed_size, testdecompressed.data(), testsize );
+
+    bool ok = decompressed_size == testsize && testdecompressed == testinput && seconds < 60.0;
+    if (!ok) printf("Zero pages round trip FAILED\n");
+
+    return ok;
+}
+
+
+/*
+** Memory to memory round trip through the stream API, the contexts are destroyed
+*/
+bool roundtrip( const char* what, const std::vector<char>& input, TurboSqueeze::ICompressor* compression_ctx, TurboSqueeze::IDecompressor* decompression_ctx, size_t* compressed = nullptr )
+{
+    std::vector<char> testoutput( TurboSqueeze::compressBound( input.size() ) );
+    std::vector<char> testdecompressed( input.size() );
+
+    auto memory_reader = TurboSqueeze::MemoryReaderFactory( (char*) input.data(), input.size() );
+    auto memory_writer = TurboSqueeze::MemoryWriterFactory( testoutput.data(), testoutput.size() );
+
+    compression_ctx->compress( memory_reader, memory_writer );
+    size_t compressed_size = memory_writer->getpos();
+
+    TurboSqueeze::WriterDestroy( memory_writer );
+    TurboSqueeze::ReaderDestroy( memory_reader );
+    TurboSqueeze::CompressorDestroy( compression_ctx );
+
+    memory_reader = TurboSqueeze::MemoryReaderFactory( testoutput.data(), compressed_size );
+    memory_writer = TurboSqueeze::MemoryWriterFactory( testdecompressed.data(), testdecompressed.size() );
+
+    decompression_ctx->decompress( memory_reader, memory_writer );
+    size_t decompressed_size = memory_writer->getpos();
+
+    TurboSqueeze::WriterDestroy( memory_writer );
+    TurboSqueeze::ReaderDestroy( memory_reader );
+    TurboSqueeze::DecompressorDestroy( decompression_ctx );
+
+    if (compressed) *compressed = compressed_size;
+
+    bool ok = decompressed_size == input.size() && testdecompressed == input;
+    printf("%s: %zu -> %zu %s\n", what, input.size(), compressed_size, ok ? "ok" : "FAILED");
+
+    return ok;
+}
+
+
+/*
+** Input mixing what the block format encodes differently: records, random bytes stored as is, a long zero run,
+** and a copy of the random bytes 1.5MB after them, which only far offsets reach
+*/
+std::vector<char> mixedInput()
+{
+    std::vector<char> data;
+    uint32_t seed = 1;
+    char record[128];
+
+    while (data.size() < (2<<20))
+    {
+        int length = snprintf( record, sizeof(record), "{\"id\":%zu,\"name\":\"user%u\",\"score\":%u}\n", data.size(), seed % 1000, (seed >> 12) % 100 );
+        data.insert( data.end(), record, record + length );
+        seed = seed * 1664525 + 1013904223;
+    }
+
+    size_t random = data.size();
+    for (uint32_t i=0; i<(512<<10); i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        data.push_back( (char) (seed >> 24) );
+    }
+
+    data.insert( data.end(), 1<<20, 0 );
+    data.insert( data.end(), data.begin() + random, data.begin() + random + (512<<10) );
+    data.insert( data.end(), data.begin(), data.begin() + (2<<20) );
+
+    return data;
+}
+
+
+/*
+** Test case: records compressed one by one with a dictionary, refused without it or with another one
+*/
+bool testdictionary( const std::vector<char>& input )
+{
+    const char* records = input.data() + (1<<20);
+    const size_t dictsize = 16<<10;
+    const size_t recordsize = 200;
+
+    std::vector<char> dictionary( input.begin(), input.begin() + dictsize );
+    std::vector<char> other( dictionary );
+    other[dictsize/2] ^= 1;
+
+    auto compression_ctx = TurboSqueeze::CompressorFactory( 2 );
+    auto decompression_ctx = TurboSqueeze::DecompressorFactory();
+    compression_ctx->setDictionary( (const uint8_t*) dictionary.data(), dictsize );
+
+    std::vector<char> testoutput( TurboSqueeze::compressBound( recordsize ) );
+    std::vector<char> testdecompressed( recordsize );
+    size_t total = 0, compressed_total = 0;
+    bool ok = true;
+
+    for (size_t i=0; i<(64<<10) && ok; i+=recordsize)
+    {
+        size_t compressed_size = TurboSqueeze::compress( compression_ctx, records + i, recordsize, testoutput.data(), testoutput.size() );
+
+        decompression_ctx->setDictionary( (const uint8_t*) dictionary.data(), dictsize );
+        ok = TurboSqueeze::decompress( decompression_ctx, testoutput.data(), compressed_size, testdecompressed.data(), recordsize ) == recordsize &&
+            memcmp( testdecompressed.data(), records + i, recordsize ) == 0;
+
+        // A stream is not decoded with another dictionary, nor without one
+        decompression_ctx->setDictionary( (const uint8_t*) other.data(), dictsize );
+        ok = ok && TurboSqueeze::decompress( decompression_ctx, testoutput.data(), compressed_size, testdecompressed.data(), recordsize ) == 0;
+        decompression_ctx->setDictionary( nullptr, 0 );
+        ok = ok && TurboSqueeze::decompress( decompression_ctx, testoutput.data(), compressed_size, testdecompressed.data(), recordsize ) == 0;
+
+        total += recordsize;
+        compressed_total += compressed_size;
+    }
+
+    printf("Dictionary, %zu byte records: %zu -> %zu %s\n", recordsize, total, compressed_total, ok ? "ok" : "FAILED");
+
+    TurboSqueeze::CompressorDestroy( compression_ctx );
+    TurboSqueeze::DecompressorDestroy( decompression_ctx );
+
+    // Linked blocks after a dictionary as long as the link: random blocks repeating the previous one only compress when
+    // their prefix is that block and not the dictionary
+    std::vector<char> largest( input.begin(), input.begin() + TurboSqueeze::MAX_DICTIONARY_SIZE );
+    std::vector<char> linked;
+    size_t linked_size = 0;
+    const size_t blocksize = (size_t) 1 << TurboSqueeze::MIN_BLOCK_BITS;
+
+    for (int n=0; n<8; n++)
+        linked.insert( linked.end(), input.begin() + (2<<20), input.begin() + (2<<20) + blocksize );
+
+    compression_ctx = TurboSqueeze::CompressorFactory( 2, 1, TurboSqueeze::MIN_BLOCK_BITS, true );
+    compression_ctx->setDictionary( (const uint8_t*) largest.data(), largest.size() );
+    decompression_ctx = TurboSqueeze::DecompressorFactory();
+    decompression_ctx->setDictionary( (const uint8_t*) largest.data(), largest.size() );
+
+    ok = roundtrip( "Dictionary, linked blocks", linked, compression_ctx, decompression_ctx, &linked_size ) && ok;
+
+    if (linked_size > linked.size() / 2)
+    {
+        printf("Dictionary, linked blocks FAILED: %zu bytes are not compressed\n", linked.size());
+        ok = false;
+    }
+
+    return ok;
+}
+
+
+/*
+** Test cases: round trips of the block format options, fails when one of them differs from its source
+*/
+bool testformats()
+{
+    std::vector<char> input = mixedInput();
+    bool ok = true;
+    char what[128];
+
+    // Levels with the smallest and the largest blocks
+    const uint32_t levels[] = { 0, 2, 8, TurboSqueeze::ULTRA_LEVEL };
+    const uint32_t bits[] = { TurboSqueeze::MIN_BLOCK_BITS, TurboSqueeze::MAX_BLOCK_BITS };
+
+    for (uint32_t level : levels)
+    {
+        for (uint32_t block_bits : bits)
+        {
+            snprintf( what, sizeof(what), "Level %u, %u bit blocks", level, block_bits );
+            ok = roundtrip( what, input, TurboSqueeze::CompressorFactory( level, 1, block_bits ), TurboSqueeze::DecompressorFactory() ) && ok;
+        }
+    }
+
+    // Linked blocks
+    for (uint32_t level : levels)
+    {
+        snprintf( what, sizeof(what), "Level %u, linked %u bit blocks", level, TurboSqueeze::MIN_BLOCK_BITS );
+        ok = roundtrip( what, input, TurboSqueeze::CompressorFactory( level, 1, TurboSqueeze::MIN_BLOCK_BITS, true ), TurboSqueeze::DecompressorFactory() ) && ok;
+    }
+
+    // Parallel compression, parallel and interleaved decoders
+    ok = roundtrip( "4 threads", input, TurboSqueeze::CompressorFactory( 2, 4, TurboSqueeze::MIN_BLOCK_BITS ), TurboSqueeze::DecompressorFactory( 4 ) ) && ok;
+    ok = roundtrip( "Interleaved", input, TurboSqueeze::CompressorFactory( 2, 1, TurboSqueeze::MIN_BLOCK_BITS ), TurboSqueeze::DecompressorFactory( 1, true ) ) && ok;
+    ok = roundtrip( "Interleaved, 4 threads", input, TurboSqueeze::CompressorFactory( 2, 4, TurboSqueeze::MIN_BLOCK_BITS ), TurboSqueeze::DecompressorFactory( 4, true ) ) && ok;
+
+    // Random data is stored, it only grows by the block headers
+    std::vector<char> random( input.begin() + (2<<20), input.begin() + (2<<20) + (512<<10) );
+    size_t stored_size = 0;
+    ok = roundtrip( "Random data", random, TurboSqueeze::CompressorFactory( 2, 1, TurboSqueeze::MIN_BLOCK_BITS ), TurboSqueeze::DecompressorFactory(), &stored_size ) && ok;
+
+    if (stored_size > random.size() + 64)
+    {
+        printf("Random data FAILED: %zu bytes are not stored\n", random.size());
+        ok = false;
+    }
+
+    // Repetitive data, one byte differs in every copy. The lazy parse of level 8 does not lose to the greedy one.
+    std::vector<char> repetitive;
+    size_t greedy_size = 0, lazy_size = 0;
+
+    for (size_t n=0; repetitive.size() < (1<<20); n++)
+    {
+        repetitive.insert( repetitive.end(), input.begin(), input.begin() + 1000 );
+        repetitive[repetitive.size() - 1 - n % 1000] ^= 1;
+    }
+
+    ok = roundtrip( "Level 7, repetitive data", repetitive, TurboSqueeze::CompressorFactory( 7 ), TurboSqueeze::DecompressorFactory(), &greedy_size ) && ok;
+    ok = roundtrip( "Level 8, repetitive data", repetitive, TurboSqueeze::CompressorFactory( 8 ), TurboSqueeze::DecompressorFactory(), &lazy_size ) && ok;
+
+    if (lazy_size > greedy_size)
+    {
+        printf("Repetitive data FAILED: level 8 is larger than level 7\n");
+        ok = false;
+    }
+
+    return testdictionary( input ) && ok;
+}
+
+
+/*
+** Optional thread count following the option, e.g. -c:5:8
+*/
+uint32_t threads( const char* option )
+{
+    const char* sep = strchr( option, ':' );
+    return sep ? atoi(sep+1) : 1;
+}
+
+
+/*
+** Optional block size in bits after the thread count, e.g. -c:5:8:20 for 1MB blocks
+*/
+uint32_t blockBits( const char* option )
+{
+    const char* sep = strchr( option, ':' );
+    sep = sep ? strchr( sep+1, ':' ) : nullptr;
+    return sep ? atoi(sep+1) : TurboSqueeze::DEFAULT_BLOCK_BITS;
 }
 
 
 int main( int argc, const char** argv )
 {
-    if (argc == 4 && strncmp(argv[1], "-c:", 3) == 0)
-        compress(argv[2], argv[3], atoi(argv[1]+3));
-    else if (argc == 4 && strncmp(argv[1], "-c", 2) == 0)
-        compress(argv[2], argv[3], 0);
-    else if (argc == 4 && strncmp(argv[1], "-d", 2) == 0)
-        decompress(argv[2], argv[3]);
+    // Optional dictionary after the output file
+    const char* dictionary = argc == 5 ? argv[4] : nullptr;
+
+    if (argc >= 4 && strncmp(argv[1], "-train:", 7) == 0)
+        train(argv[2], atoi(argv[1]+7) << 10, argc-3, argv+3);
+    else if (argc >= 4 && strncmp(argv[1], "-train", 6) == 0)
+        train(argv[2], 16 << 10, argc-3, argv+3);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-cl:", 4) == 0)
+        compress(argv[2], argv[3], atoi(argv[1]+4), threads(argv[1]+4), blockBits(argv[1]+4), true, dictionary);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-cl", 3) == 0)
+        compress(argv[2], argv[3], 0, 1, TurboSqueeze::DEFAULT_BLOCK_BITS, true, dictionary);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-c:", 3) == 0)
+        compress(argv[2], argv[3], atoi(argv[1]+3), threads(argv[1]+3), blockBits(argv[1]+3), false, dictionary);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-c", 2) == 0)
+        compress(argv[2], argv[3], 0, 1, TurboSqueeze::DEFAULT_BLOCK_BITS, false, dictionary);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-di", 3) == 0)
+        decompress(argv[2], argv[3], threads(argv[1]), true, dictionary);
+    else if ((argc == 4 || argc == 5) && strncmp(argv[1], "-d", 2) == 0)
+        decompress(argv[2], argv[3], threads(argv[1]), false, dictionary);
     else if (argc == 2 && strncmp(argv[1], "-t", 2) == 0)
-        test();
+    {
+        if (!test()) return 1;
+    }
     else if (argc == 2 && strncmp(argv[1], "-u", 2) == 0)
-        testfile();
+    {
+        bool ok = testfile();
+        ok = testformats() && ok;
+        ok = testzeros() && ok;
+        if (!ok) return 1;
+    }
     else
     {
         printf("TurboSqueeze v0.5\n"
         "(C) 2024, Julien Perrier-cornet. Free software under the BSD 3-clause License.\n"
         "\n"
-        "To compress: tsq -c:0..10 input output\n"
-        "To decompress: tsq -d input output\n"
+        "To compress: tsq -c:0..11[:threads[:16..22 block bits]] input output [dictionary]\n"
+        "With linked blocks: tsq -cl:0..11[:threads[:16..22 block bits]] input output [dictionary]\n"
+        "To decompress: tsq -d[:threads] input output [dictionary]\n"
+        "Multi-stream decompression: tsq -di[:threads] input output [dictionary]\n"
+        "To train a dictionary on the lines of the samples: tsq -train[:1..64 KB] dictionary samples...\n"
         "Test/Benchmark: tsq -t\n"
+        "Round trip tests: tsq -u\n"
         );
         return 1;
     }
@@ -35,6 +35,56 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "turbosqueeze.h"
 #include <cstring> // for memset
 #include <cassert> // for assert
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TURBOSQUEEZE_X86 1
+#if _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// NEON is always available on aarch64
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define TURBOSQUEEZE_ARM64 1
+#include <arm_neon.h>
+#endif
+
+// SSE2 is part of the x86-64 base ISA
+#if defined(__SSE2__) || defined(_M_X64)
+#define TURBOSQUEEZE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if _MSC_VER
+static inline uint32_t turbosqueeze_ctz( uint64_t a ) { unsigned long r; _BitScanForward64( &r, a ); return r; }
+#else
+#define turbosqueeze_ctz( A ) __builtin_ctzll( A )
+#endif
+
+#if _MSC_VER && TURBOSQUEEZE_X86
+#define turbosqueeze_prefetch( P ) _mm_prefetch( (const char*) (P), _MM_HINT_T0 )
+#elif _MSC_VER
+#define turbosqueeze_prefetch( P ) ((void) (P))
+#else
+#define turbosqueeze_prefetch( P ) __builtin_prefetch( P )
+#endif
 
 
 #if _MSC_VER
@@ -48,17 +98,92 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define MAX_CACHE_LINE_SIZE 128
 
+// Mapped input is prefetched this far ahead of the reading position
+#define TURBOSQUEEZE_READAHEAD_SZ (8<<20)
+
+
+// Block sizes come from the block bits of the compressor or of the frame header
+#define TURBOSQUEEZE_BLOCK_SZ( BITS ) (1u<<(BITS))
+#define TURBOSQUEEZE_OUTPUT_SZ( BITS ) ((1u<<(BITS)) + (1u<<((BITS)-2)))
+#define TURBOSQUEEZE_MAX_OUTPUT_SZ TURBOSQUEEZE_OUTPUT_SZ( MAX_BLOCK_BITS )
+
+// Frame header: "TSQ", format version, block bits, flags
+#define TURBOSQUEEZE_FRAME_HEADER_SZ (6)
+#define TURBOSQUEEZE_FRAME_VERSION (4)
+
+// Flags of the frame header: the blocks reference the end of the previous block, the blocks reference a dictionary
+#define TURBOSQUEEZE_FRAME_LINKED (1)
+#define TURBOSQUEEZE_FRAME_DICTIONARY (2)
+
+// The id of the dictionary follows the frame header, little endian
+#define TURBOSQUEEZE_DICT_ID_SZ (4)
+
+// Linked blocks keep this much of the previous block in front of the next one, for the encoder and the decoder.
+// The dictionary is the first prefix, MAX_DICTIONARY_SIZE is the same size.
+#define TURBOSQUEEZE_LINK_SZ (1u<<16)
+
+// Bit 23 of the decoded size of a block: the block has escapes, 22 bit match offsets (frame version 2) or long tokens (version 3)
+#define TURBOSQUEEZE_ESCAPES (1u<<23)
+
+// Bit 23 of the compressed size of a block: the block is stored as is, it did not shrink (frame version 4)
+#define TURBOSQUEEZE_STORED (1u<<23)
+
+// 24 bit field after a 0 offset escape: the offset, then the long token bits. Long tokens are followed by their length
+// minus 17 in 7 bit groups, and long literal runs by their literals.
+#define TURBOSQUEEZE_OFFSET_MASK ((1u<<22) - 1)
+#define TURBOSQUEEZE_LONG_TOKEN (1u<<23)
+#define TURBOSQUEEZE_LONG_LITERALS (1u<<22)
+
+// The last bytes of a block are decoded exactly, so no wild copy goes past the end of the block
+#define TURBOSQUEEZE_TAIL_SZ (256)
+
+// Worst case encoded block with its header: 16 literals cost at most 16 + 5/8 bytes, plus the wild copy slack
+#define TURBOSQUEEZE_BLOCK_BOUND( N ) ((N) + (N)/16 + 64)
+
+// Arena layout of the multi-stream decoders: compressed block then decoded block, for each stream
+#define TURBOSQUEEZE_MAX_STREAMS (16)
+#define TURBOSQUEEZE_STREAM_SZ( BITS ) (TURBOSQUEEZE_OUTPUT_SZ( BITS ) + TURBOSQUEEZE_BLOCK_SZ( BITS ) + MAX_CACHE_LINE_SIZE)
+
 
-#define TURBOSQUEEZE_BLOCK_BITS (18)
-#define TURBOSQUEEZE_BLOCK_SZ (1<<TURBOSQUEEZE_BLOCK_BITS)
-#define TURBOSQUEEZE_OUTPUT_SZ ((1<<TURBOSQUEEZE_BLOCK_BITS) + (1<<(TURBOSQUEEZE_BLOCK_BITS-2)))
+// Matches reach 64 KB back at most, so the tables do not grow with the block size
+#define TURBOSQUEEZE_REFHASH_BITS (17)
+#define TURBOSQUEEZE_REFHASH_PLUS_BITS (18)
+#define TURBOSQUEEZE_REFHASH_PLUS_SZ (1<<TURBOSQUEEZE_REFHASH_PLUS_BITS)
+#define TURBOSQUEEZE_REFHASH_ENTITIES (7)
 
+// Level 0 buckets take one cache line: 7 symbols and the bucket count, then their positions.
+// The 1 MB table stays in the L2 cache, the bucket of the position 8 bytes ahead is prefetched.
+#define TURBOSQUEEZE_BUCKET_BITS (14)
+#define TURBOSQUEEZE_BUCKET_SZ (1<<TURBOSQUEEZE_BUCKET_BITS)
+#define TURBOSQUEEZE_BUCKET_PREFETCH (8)
 
-#define TURBOSQUEEZE_REFHASH_BITS (TURBOSQUEEZE_BLOCK_BITS-1)
-#define TURBOSQUEEZE_REFHASH_SZ (1<<TURBOSQUEEZE_REFHASH_BITS)
-#define TURBOSQUEEZE_REFHASH_PLUS_SZ (1<<TURBOSQUEEZE_BLOCK_BITS)
-#define TURBOSQUEEZE_REFHASH_ENTITIES (4)
-#define TURBOSQUEEZE_MAX_SYMS (1<<(TURBOSQUEEZE_BLOCK_BITS-3))
+// Hash chains of levels 1 and up link the positions of the block, as far as the far window
+#define TURBOSQUEEZE_CHAIN_BITS (22)
+
+// Farthest 16 bit match offset. Farther matches take a 0 offset escape and a 22 bit offset, so they must
+// be long enough to pay for the 3 extra bytes. Positions out of the far window are replaced in the tables.
+#define TURBOSQUEEZE_WINDOW_SZ ((1<<16) - 32)
+#define TURBOSQUEEZE_FAR_WINDOW_SZ (1<<22)
+#define TURBOSQUEEZE_FAR_MIN_MATCH (8)
+
+// Shortest match or literal run sent as a long token, shorter ones are split in 16 byte tokens
+#define TURBOSQUEEZE_LONG_MIN (64)
+
+// From this level the parse is lazy: a match is dropped for a literal and a better match at the next position
+#define TURBOSQUEEZE_LAZY_LEVEL (8)
+
+// With acceleration, the literal scan step grows by one every 1<<SKIP_TRIGGER positions without a match
+#define TURBOSQUEEZE_SKIP_TRIGGER (6)
+
+// Optimal parse costs, in eighths of a byte: every token takes a control bit and half a size byte
+#define TURBOSQUEEZE_TOKEN_COST (5)
+#define TURBOSQUEEZE_PARSE_LITERALS (0xFFFFFFFFu)
+
+// Bucket counts hold a 5 bit block generation above a 3 bit count, stale generations read as empty
+#define TURBOSQUEEZE_GENERATIONS (32)
+
+#define TURBOSQUEEZE_MIN_HASH_BITS (8)
+#define turbosqueeze_bucket_count( TAG, GEN ) (((TAG) >> 3) == (GEN) ? (TAG) & 7 : 0)
 
 
 #define turbosqueeze_memcpy8( A, B ) *((uint64_t*) (A)) = *((const uint64_t*) (B))
@@ -81,6 +206,13 @@ namespace TurboSqueeze {
         return reader;
     }
 
+	MappedFileReader* MappedFileReaderFactory( const char *filename )
+    {
+		MappedFileReader* reader = new MappedFileReader();
+        if (reader) reader->set( filename );
+        return reader;
+    }
+
 	MemoryReader* MemoryReaderFactory( char* buffer, size_t size )
     {
 		MemoryReader* reader = new MemoryReader();
@@ -124,8 +256,8 @@ namespace TurboSqueeze {
 
         if (!memory)
         {
-        	memory = new uint8_t[TURBOSQUEEZE_OUTPUT_SZ];
-        	size = TURBOSQUEEZE_OUTPUT_SZ;
+        	memory = new uint8_t[TURBOSQUEEZE_MAX_OUTPUT_SZ];
+        	size = TURBOSQUEEZE_MAX_OUTPUT_SZ;
         }
 
         if (!memory || bufferSize>=size) return 0;
@@ -141,6 +273,89 @@ namespace TurboSqueeze {
     	delete [] memory;
     }
 
+    void MappedFileReader::open()
+    {
+        opened = true;
+
+    #if defined(_WIN32)
+        HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+        if (file == INVALID_HANDLE_VALUE) return;
+
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0)
+        {
+            HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+
+            if (mapping != nullptr)
+            {
+                memoryData = (char*) MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+                memorySize = memoryData ? (size_t) fileSize.QuadPart : 0;
+                CloseHandle( mapping );
+            }
+        }
+
+        CloseHandle( file );
+    #else
+        int fd = ::open( filename, O_RDONLY );
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat( fd, &st ) == 0 && st.st_size > 0)
+        {
+            void* mapping = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+            if (mapping != MAP_FAILED)
+            {
+                memoryData = (char*) mapping;
+                memorySize = st.st_size;
+                madvise( memoryData, memorySize, MADV_SEQUENTIAL );
+            }
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        close( fd );
+    #endif
+    }
+
+    size_t MappedFileReader::read(char** buffer, size_t *bufferStart, size_t bufferSize)
+    {
+        if (!opened) open();
+
+        if (!memoryData) return 0;
+
+        size_t remaining = memorySize - currentPosition;
+        size_t bytesToRead = remaining < bufferSize ? remaining : bufferSize;
+
+    #if !defined(_WIN32)
+        // Keep the kernel reading ahead of the consumer, the next window is requested half way through the current one
+        if (currentPosition + bytesToRead + TURBOSQUEEZE_READAHEAD_SZ/2 > advised && advised < memorySize)
+        {
+            size_t start = (advised > currentPosition ? advised : currentPosition) & ~((size_t) 4095);
+            size_t length = memorySize - start < TURBOSQUEEZE_READAHEAD_SZ ? memorySize - start : TURBOSQUEEZE_READAHEAD_SZ;
+
+            madvise( memoryData + start, length, MADV_WILLNEED );
+            advised = start + length;
+        }
+    #endif
+
+        *buffer = memoryData;
+        *bufferStart = currentPosition;
+        currentPosition += bytesToRead;
+
+        return bytesToRead;
+    }
+
+    MappedFileReader::~MappedFileReader()
+    {
+        if (!memoryData) return;
+
+    #if defined(_WIN32)
+        UnmapViewOfFile( memoryData );
+    #else
+        munmap( memoryData, memorySize );
+    #endif
+    }
+
     size_t MemoryReader::read(char** buffer, size_t *bufferStart, size_t bufferSize)
     {
         size_t remaining = memorySize - currentPosition;
@@ -160,25 +375,100 @@ namespace TurboSqueeze {
     // Writer
     void FileWriter::getdest(char** data, size_t size)
     {
-        if (!buffer) buffer = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_OUTPUT_SZ);
+        *data = nullptr;
 
-        if (buffer != nullptr && size <= TURBOSQUEEZE_OUTPUT_SZ)
-            *data = (char*) buffer;
-        else
-            *data = nullptr;
+        if (size > TURBOSQUEEZE_MAX_OUTPUT_SZ) return;
+
+        // The next buffer after the ones waiting to be flushed, wait for one to be released if they are all in flight
+        std::unique_lock<std::mutex> guard( lock );
+        changed.wait( guard, [this] { return pending < nBuffers; } );
+
+        if (failed) return;
+
+        uint32_t k = (first + pending) % nBuffers;
+
+        if (!buffers[k]) buffers[k] = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_MAX_OUTPUT_SZ );
+
+        *data = (char*) buffers[k];
     }
 
     void FileWriter::write( size_t dataSize )
     {
-        if (!outfile) outfile = fopen(filename, "wb");
-        if (!outfile) return;
-        size_t writen = fwrite((char*) buffer, 1, dataSize, outfile);
+        // Not opened again after close()
+        if (!outfile && !failed && !stop) outfile = fopen(filename, "wb");
+        if (!outfile)
+        {
+            failed = true;
+            return;
+        }
+
+        if (!flusher) flusher = new std::thread( &FileWriter::flush, this );
+
+        std::lock_guard<std::mutex> guard( lock );
+
+        sizes[(first + pending) % nBuffers] = dataSize;
+        pending++;
+        position += dataSize;
+
+        changed.notify_all();
+    }
+
+    // Background thread writing the buffers in order
+    void FileWriter::flush()
+    {
+        std::unique_lock<std::mutex> guard( lock );
+
+        while (true)
+        {
+            changed.wait( guard, [this] { return pending > 0 || stop; } );
+
+            if (pending == 0) break;
+
+            uint8_t *buffer = buffers[first];
+            size_t size = sizes[first];
+
+            // Buffers after a short write are dropped, the file is already incomplete
+            if (!failed)
+            {
+                guard.unlock();
+                bool written = fwrite( (char*) buffer, 1, size, outfile ) == size;
+                guard.lock();
+
+                if (!written) failed = true;
+            }
+
+            first = (first + 1) % nBuffers;
+            pending--;
+
+            changed.notify_all();
+        }
+    }
+
+    void FileWriter::close()
+    {
+        {
+            std::lock_guard<std::mutex> guard( lock );
+            stop = true;
+            changed.notify_all();
+        }
+
+        if (flusher)
+        {
+            flusher->join();
+            delete flusher;
+            flusher = nullptr;
+        }
+
+        if (outfile && fclose( outfile ) != 0) failed = true;
+        outfile = nullptr;
     }
 
     FileWriter::~FileWriter()
     {
-    	if (outfile) fclose(outfile);
-        if (buffer) align_free(buffer);
+        close();
+
+        for (uint32_t k=0; k<nBuffers; k++)
+            if (buffers[k]) align_free(buffers[k]);
     }
 
     void MemoryWriter::getdest(char** data, size_t dataSize)
@@ -207,46 +497,61 @@ namespace TurboSqueeze {
 
     // Compressor declaration and factory
     class FastCompressor : public ICompressor {
-    #pragma pack(1)
-        struct SymRefFast {
-            uint32_t sym4;
-            uint32_t latest_pos;
+        struct RefBucket {
+            uint32_t sym4[TURBOSQUEEZE_REFHASH_ENTITIES];
+            uint32_t count;
+            uint32_t latest_pos[TURBOSQUEEZE_REFHASH_ENTITIES];
+            uint32_t unused;
         };
-    #pragma pack()
-        struct SymRefFast *refhash;
-        uint8_t *refhashcount;
-        void init() override;
-        bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos) override;
+        struct RefBucket *refhash;
+        uint32_t generation;
+        uint32_t hashBits;
+        uint32_t dirtyBuckets;
+        void init( uint32_t inputSize ) override;
+        bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, bool extend, uint32_t &hitlength, uint32_t &hitpos) override;
+        ICompressor* createWorker() override { return new FastCompressor( compressionLevel ); }
     public:
+        uint32_t getLevel() const override { return 0; }
         FastCompressor( uint32_t compression_level );
         ~FastCompressor();
     };
 
+    // The head of a hash is its latest position and the chain links every position to the previous one with the same
+    // hash. Entries hold the position plus the base of their block, so entries of older blocks read as empty.
     class FastNCompressor : public ICompressor {
-    #pragma pack(1)
-        struct SymRef {
-            uint32_t sym4;
-            uint32_t position;
-            uint32_t n_occurences;
-        };
-    #pragma pack()
-        struct SymRef *hash;
-        uint32_t *positions;
-        uint8_t *refhashcount;
-        uint32_t posIdx;
-        void init() override;
-        bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos) override;
+        uint32_t *head;
+        uint32_t *chain;
+        uint32_t hashBits;
+        uint32_t chainBits;
+        uint32_t dirtyBuckets;
+        uint32_t base;
+        uint32_t nextBase;
+        uint32_t level;
+        void init( uint32_t inputSize ) override;
+        bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, bool extend, uint32_t &hitlength, uint32_t &hitpos) override;
+        ICompressor* createWorker() override { return new FastNCompressor( level ); }
     public:
+        uint32_t getLevel() const override { return level; }
         FastNCompressor( uint32_t compression_level );
         ~FastNCompressor();
     };
 
-    class ICompressor* CompressorFactory( uint32_t compression_level )
+    class ICompressor* CompressorFactory( uint32_t compression_level, uint32_t n_threads, uint32_t block_bits, bool linked_blocks )
     {
-        if (compression_level>0 && compression_level<=10)
-            return new FastNCompressor( compression_level );
+        ICompressor* compressor;
+
+        if (compression_level>0 && compression_level<=ULTRA_LEVEL)
+            compressor = new FastNCompressor( compression_level );
+        else
+            compressor = new FastCompressor( 0 );
 
-        return new FastCompressor( 0 );
+        if (compressor)
+        {
+            compressor->setThreads( n_threads );
+            compressor->setBlockBits( block_bits );
+            compressor->setLinkedBlocks( linked_blocks );
+        }
+        return compressor;
     }
 
     void CompressorDestroy( ICompressor* compressor )
@@ -254,500 +559,2339 @@ namespace TurboSqueeze {
         delete compressor;
     }
 
-    // Compression helpers
-    struct seqEntry {
-        bool repeat;
-        uint8_t size;
-        uint32_t position;
-        uint32_t base;
-    };
+    CompressorPool* CompressorPoolFactory()
+    {
+        return new CompressorPool();
+    }
 
+    void CompressorPoolDestroy( CompressorPool* pool )
+    {
+        delete pool;
+    }
 
-    static uint32_t writeOutput( struct seqEntry *entryBuffer, uint32_t *entryPos, uint8_t *outptr, uint8_t *input, bool finalize, uint32_t processed )
+    // Levels outside 1..ULTRA_LEVEL all map to the level 0 compressor
+    static inline uint32_t poolLevel( uint32_t compression_level )
     {
-        uint8_t ctrl_byte = entryBuffer[0].repeat;
-        uint32_t i = 0;
+        return (compression_level>0 && compression_level<=ULTRA_LEVEL) ? compression_level : 0;
+    }
+
+    ICompressor* CompressorPool::acquire( uint32_t compression_level )
+    {
+        uint32_t level = poolLevel( compression_level );
 
-        for (uint32_t j=1; j<8; j++)
         {
-            ctrl_byte = (ctrl_byte << 1) | entryBuffer[j].repeat;
+            std::lock_guard<std::mutex> guard( lock );
+
+            if (!available[level].empty())
+            {
+                ICompressor* compressor = available[level].back();
+                available[level].pop_back();
+                return compressor;
+            }
         }
 
-        outptr[i++] = ctrl_byte;
+        return CompressorFactory( level );
+    }
 
-        for (uint32_t j=0; j < 4 && ((j*2) < (*entryPos)); j++)
-        {
-            uint8_t size_byte = ((entryBuffer[j*2].size - 1) << 4) |  (entryBuffer[j*2+1].size - 1);
+    void CompressorPool::release( ICompressor* compressor )
+    {
+        if (compressor == nullptr) return;
+
+        compressor->reset();
+        compressor->setDictionary( nullptr, 0 );
+        compressor->setSearchDepth( 0 );
+        compressor->setAcceleration( compressor->getLevel() == 0 ? DEFAULT_ACCELERATION : 0 );
+        compressor->setLinkedBlocks( false );
+        compressor->setBlockBits( DEFAULT_BLOCK_BITS );
+        compressor->setThreads( 1 );
+
+        std::lock_guard<std::mutex> guard( lock );
+        available[poolLevel( compressor->getLevel() )].push_back( compressor );
+    }
 
-            outptr[i++] = size_byte;
+    void CompressorPool::reserve( uint32_t compression_level, uint32_t count )
+    {
+        uint32_t level = poolLevel( compression_level );
 
-            if (entryBuffer[j*2].repeat)
-            {
-                uint32_t offset = entryBuffer[j*2].base - entryBuffer[j*2].position;
-                outptr[i] = offset & 0xFF;
-                outptr[i+1] = (offset >> 8) & 0xFF;
-                i += 2;
-            }
-            else
-            {
-            	turbosqueeze_memcpy16( &outptr[i], &input[entryBuffer[j*2].position] );
-                i += entryBuffer[j*2].size;
-            }
+        for (uint32_t k=0; k<count; k++)
+        {
+            ICompressor* compressor = CompressorFactory( level );
+            if (!compressor) return;
 
-            if (((j*2+1) < (*entryPos)))
-            {
-                if (entryBuffer[j*2+1].repeat)
-                {
-                    uint32_t offset = entryBuffer[j*2].base - entryBuffer[j*2+1].position;
-                    outptr[i] = offset & 0xFF;
-                    outptr[i+1] = (offset >> 8) & 0xFF;
-                    i += 2;
-                }
-                else
-                {
-                	turbosqueeze_memcpy16( &outptr[i], &input[entryBuffer[j*2+1].position] );
-                    i += entryBuffer[j*2+1].size;
-                }
-            }
+            std::lock_guard<std::mutex> guard( lock );
+            available[level].push_back( compressor );
         }
+    }
 
-        if ((*entryPos) >= 8)
-            *entryPos -= 8;
-        else
-            *entryPos = 0;
+    CompressorPool::~CompressorPool()
+    {
+        for (uint32_t level=0; level<nLevels; level++)
+            for (ICompressor* compressor : available[level])
+                CompressorDestroy( compressor );
+    }
 
-        if ((*entryPos) == 1)
-        {
-            entryBuffer[0].repeat = entryBuffer[8].repeat;
-            entryBuffer[0].size = entryBuffer[8].size;
-            entryBuffer[0].position = entryBuffer[8].position;
-            entryBuffer[0].base = entryBuffer[8].base;
+    // Cheapest costs to a position when the next token starts a pair (even) or is the second one of its pair (odd),
+    // with the tokens reaching them. The pair of an odd state starts at the token reaching it.
+    // 24 bytes per position of the block and its prefix. The position of the token taken from a node is read at the
+    // node where it ends, in the state of the other parity.
+    struct ParseNode {
+        // The cost of the even state is replaced by the length of the token taken from here once the path is known
+        union {
+            uint32_t evenCost;
+            uint32_t length;
+        };
+        uint32_t oddCost;
+        uint32_t evenLength;
+        uint32_t evenPosition;
+        uint32_t oddLength;
+        uint32_t oddPosition;
+    };
 
-            if (finalize)
+    ICompressor::~ICompressor()
+    {
+        for (uint32_t k=0; k<nWorkers; k++)
+            delete workers[k];
+        delete [] workers;
+        if (scratch) align_free( scratch );
+        if (window) align_free( window );
+        delete [] dictionary;
+        delete [] dictIndex;
+        delete [] parseNodes;
+    }
+
+    void ICompressor::setThreads( uint32_t n_threads )
+    {
+        for (uint32_t k=0; k<nWorkers; k++)
+            delete workers[k];
+        delete [] workers;
+
+        workers = nullptr;
+        nWorkers = 0;
+
+        // This context is the first worker
+        if (n_threads > 1)
+        {
+            workers = new ICompressor* [n_threads-1];
+            for (uint32_t k=0; k<n_threads-1; k++)
             {
-                i += writeOutput( entryBuffer, entryPos, outptr+i, input, true, processed+i );
+                workers[nWorkers++] = createWorker();
+                workers[k]->setDictionary( dictionary, dictSize );
+                workers[k]->setSearchDepth( compressionLevel );
+                workers[k]->setAcceleration( acceleration );
             }
         }
+    }
 
-        return i;
+    // Candidates compared per position by each level. The greedy levels stop gaining past 128, the lazy ones past 512.
+    static const uint32_t levelDepths[ULTRA_LEVEL+1] = { 0, 2, 4, 8, 16, 32, 64, 128, 32, 128, 512, 512 };
+
+    static inline uint32_t levelDepth( uint32_t level )
+    {
+        return level <= ULTRA_LEVEL ? levelDepths[level] : 0;
     }
 
-    // Compression method
-    void ICompressor::compress(IReader* reader, IWriter* writer)
+    void ICompressor::setSearchDepth( uint32_t depth )
     {
-    	if (reader == nullptr || writer == nullptr) return;
+        compressionLevel = depth ? depth : levelDepth( getLevel() );
 
-    	do
-        {
-            uint8_t *inbuff;
-            size_t i;
+        for (uint32_t k=0; k<nWorkers; k++)
+            workers[k]->setSearchDepth( compressionLevel );
+    }
 
-            size_t input_sz = reader->read((char**) &inbuff, &i, TURBOSQUEEZE_BLOCK_SZ);
+    void ICompressor::setAcceleration( uint32_t accel )
+    {
+        acceleration = accel;
 
-            if (input_sz > 0)
-            {
-                uint8_t *outbuff;
-                writer->getdest( (char**) &outbuff, TURBOSQUEEZE_OUTPUT_SZ );
+        for (uint32_t k=0; k<nWorkers; k++)
+            workers[k]->setAcceleration( acceleration );
+    }
 
-                uint32_t outputSize = 0;
-                encode( inbuff+i, outbuff+3, &outputSize, input_sz );
+    // FNV-1a of the dictionary, so a stream is not decoded with another dictionary
+    static uint32_t dictionaryId( const uint8_t *dict, uint32_t size )
+    {
+        uint32_t h = 2166136261u;
 
-                outbuff[0] = (outputSize & 0xFF);
-                outbuff[1] = ((outputSize >> 8) & 0xFF);
-                outbuff[2] = ((outputSize >> 16) & 0xFF);
+        for (uint32_t i=0; i<size; i++)
+            h = (h ^ dict[i]) * 16777619u;
 
-                writer->write(outputSize);
-            }
-        }
-        while ( !reader->eof() ) ;
+        return h;
     }
 
-    void ICompressor::encode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
+    // Only the end of the dictionary is in reach of the blocks, it is kept
+    static void copyDictionary( uint8_t **dictionary, uint32_t *dictSize, uint32_t *dictId, const uint8_t *dict, size_t size )
     {
-        const uint32_t size = inputSize;
+        delete [] *dictionary;
 
-        // First write the uncompressed size
-        outputBlock[0] = (size & 0xFF);
-        outputBlock[1] = ((size >> 8) & 0xFF);
-        outputBlock[2] = ((size >> 16) & 0xFF);
+        *dictionary = nullptr;
+        *dictSize = 0;
+        *dictId = 0;
 
-        *outputSize = 3;
+        if (dict == nullptr || size == 0) return;
+
+        if (size > MAX_DICTIONARY_SIZE)
+        {
+            dict += size - MAX_DICTIONARY_SIZE;
+            size = MAX_DICTIONARY_SIZE;
+        }
 
-        init();
+        *dictionary = new uint8_t [size];
+        memcpy( *dictionary, dict, size );
+        *dictSize = size;
+        *dictId = dictionaryId( *dictionary, *dictSize );
+    }
 
-        uint32_t entryPos = 0;
-        struct seqEntry entryBuffer[9];
+    // The window holds LINK_SZ bytes of prefix in front of a block, the dictionary is copied at the end of them.
+    // Linked blocks overwrite it, the dictionary is then copied again for the next stream.
+    static bool loadWindow( uint8_t **window, uint32_t *windowBits, bool *windowLoaded, uint32_t blockBits, const uint8_t *dictionary, uint32_t dictSize )
+    {
+        if (*window == nullptr || *windowBits < blockBits)
+        {
+            if (*window) align_free( *window );
 
-        uint32_t i = 0;
-        uint32_t j = 3;
-        uint32_t last_i = i;
-        uint32_t rep_last_i = i;
-        uint8_t *outptr = outputBlock;
+            *window = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_LINK_SZ + TURBOSQUEEZE_BLOCK_SZ( blockBits ) + MAX_CACHE_LINE_SIZE );
+            *windowBits = *window ? blockBits : 0;
+            *windowLoaded = false;
 
-        static uint32_t block;
+            if (!*window) return false;
+        }
 
-        while (i < size)
+        if (!*windowLoaded)
         {
-            bool hit = false;
-            uint32_t hitlength = -1;
-            uint32_t hitpos = -1;
+            if (dictSize) memcpy( *window+TURBOSQUEEZE_LINK_SZ-dictSize, dictionary, dictSize );
+            *windowLoaded = true;
+        }
 
-            last_i = i;
+        return true;
+    }
 
-            // Count Litteral characters until the next match
-            while ((i < size) && ((i-last_i) < 16))
-            {
-                hit = addHit( inputBlock, i, rep_last_i, size, hitlength, hitpos );
-                hit = hit && ((rep_last_i - hitpos) < ((1<<16) - 32)) && ((hitpos + hitlength) < rep_last_i);
-                if (hit) break;
-                i++;
-            }
+    void ICompressor::setDictionary( const uint8_t* dict, size_t size )
+    {
+        copyDictionary( &dictionary, &dictSize, &dictId, dict, size );
+        windowLoaded = false;
+        indexDictionary();
 
-            // Litterals
-            if ((i-last_i) > 0)
-            {
-                entryBuffer[entryPos].repeat = false;
-                entryBuffer[entryPos].size = i-last_i;
-                entryBuffer[entryPos].position = last_i;
-                entryBuffer[entryPos].base = rep_last_i;
-                entryPos++;
+        // The workers encode blocks with the dictionary in front of them too
+        for (uint32_t k=0; k<nWorkers; k++)
+            workers[k]->setDictionary( dict, size );
+    }
 
-                if ((entryPos & 1) == 0)
+    void ICompressor::setBlockBits( uint32_t block_bits )
+    {
+        if (block_bits < MIN_BLOCK_BITS) block_bits = MIN_BLOCK_BITS;
+        if (block_bits > MAX_BLOCK_BITS) block_bits = MAX_BLOCK_BITS;
+
+        // The scratch block is sized for the previous blocks
+        if (block_bits != blockBits && scratch)
+        {
+            align_free( scratch );
+            scratch = nullptr;
+        }
+
+        blockBits = block_bits;
+    }
+
+    /*
+     * Block pipeline: slot k is served by its own thread. The caller submits a block to a slot, then waits
+     * for the slot before reusing it. Visiting the slots round robin keeps the blocks in stream order.
+     */
+    class BlockPipeline {
+        enum { Idle, Pending, Done };
+        std::mutex mutex;
+        std::condition_variable pending;
+        std::condition_variable done;
+        std::thread *threads;
+        uint32_t *states;
+        uint32_t nSlots;
+        bool quit;
+        std::function<void(uint32_t)> job;
+        void run( uint32_t slot );
+    public:
+        BlockPipeline( uint32_t n_slots, std::function<void(uint32_t)> slot_job );
+        ~BlockPipeline();
+        bool wait( uint32_t slot );
+        void submit( uint32_t slot );
+    };
+
+    BlockPipeline::BlockPipeline( uint32_t n_slots, std::function<void(uint32_t)> slot_job ) : nSlots( n_slots ), quit( false ), job( slot_job )
+    {
+        states = new uint32_t [nSlots];
+        for (uint32_t k=0; k<nSlots; k++)
+            states[k] = Idle;
+
+        threads = new std::thread [nSlots];
+        for (uint32_t k=0; k<nSlots; k++)
+            threads[k] = std::thread( &BlockPipeline::run, this, k );
+    }
+
+    BlockPipeline::~BlockPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            quit = true;
+        }
+        pending.notify_all();
+
+        for (uint32_t k=0; k<nSlots; k++)
+            threads[k].join();
+
+        delete [] threads;
+        delete [] states;
+    }
+
+    void BlockPipeline::run( uint32_t slot )
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+
+        while (true)
+        {
+            pending.wait( lock, [&] { return quit || states[slot] == Pending; } );
+            if (states[slot] != Pending) break;
+
+            lock.unlock();
+            job( slot );
+            lock.lock();
+
+            states[slot] = Done;
+            done.notify_all();
+        }
+    }
+
+    // Returns true when the slot holds a processed block, the slot is then free for the next block
+    bool BlockPipeline::wait( uint32_t slot )
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        done.wait( lock, [&] { return states[slot] != Pending; } );
+
+        bool processed = states[slot] == Done;
+        states[slot] = Idle;
+        return processed;
+    }
+
+    void BlockPipeline::submit( uint32_t slot )
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            states[slot] = Pending;
+        }
+        pending.notify_all();
+    }
+
+    // Compression helpers
+    struct seqEntry {
+        bool repeat;
+        bool literals;
+        uint32_t size;
+        uint32_t position;
+        uint32_t base;
+    };
+
+
+    static inline bool usableMatch( uint32_t offset, uint32_t length )
+    {
+        return offset < TURBOSQUEEZE_WINDOW_SZ || (offset < TURBOSQUEEZE_FAR_WINDOW_SZ && length >= TURBOSQUEEZE_FAR_MIN_MATCH);
+    }
+
+    // Repeats read data decoded before the base of their pair, except long ones which are decoded alone and
+    // copied 16 bytes at a time, so their source only has to be 16 bytes behind
+    static inline bool validHit( uint32_t hitpos, uint32_t hitlength, uint32_t base, uint32_t i )
+    {
+        if (hitlength > 16)
+            return hitpos < base && i - hitpos >= 16 && base - hitpos < TURBOSQUEEZE_FAR_WINDOW_SZ;
+
+        return ((hitpos + hitlength) < base) && usableMatch( base - hitpos, hitlength );
+    }
+
+    // Length of a 16 byte match, kept only when it is long enough for a long token
+    static inline uint32_t extendMatch( uint8_t *input, uint32_t first, uint32_t second, uint32_t size )
+    {
+        uint32_t length = 16;
+
+        while (second + length + 8 <= size && *((uint64_t*) (input+first+length)) == *((uint64_t*) (input+second+length)))
+            length += 8;
+
+        while (second + length < size && input[first+length] == input[second+length])
+            length++;
+
+        return length >= TURBOSQUEEZE_LONG_MIN ? length : 16;
+    }
+
+    static inline uint32_t writeOffset( uint8_t *outptr, uint32_t offset )
+    {
+        if (offset < TURBOSQUEEZE_WINDOW_SZ)
+        {
+            outptr[0] = offset & 0xFF;
+            outptr[1] = (offset >> 8) & 0xFF;
+            return 2;
+        }
+
+        outptr[0] = 0;
+        outptr[1] = 0;
+        outptr[2] = offset & 0xFF;
+        outptr[3] = (offset >> 8) & 0xFF;
+        outptr[4] = (offset >> 16) & 0xFF;
+        return 5;
+    }
+
+    // Long token lengths, 7 bits per byte
+    static inline uint32_t writeLength( uint8_t *outptr, uint32_t length )
+    {
+        uint32_t value = length - 17;
+        uint32_t i = 0;
+
+        while (value >= 0x80)
+        {
+            outptr[i++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+
+        outptr[i++] = value;
+        return i;
+    }
+
+    // Literals are copied 16 bytes at a time, except at the end of the input which may be the end of a mapping
+    static inline void copyLiterals( uint8_t *outptr, uint8_t *input, uint32_t position, uint32_t size, uint32_t inputSize )
+    {
+        if (size <= 16 && position + 16 <= inputSize)
+            turbosqueeze_memcpy16( outptr, &input[position] );
+        else
+            memcpy( outptr, &input[position], size );
+    }
+
+    static inline uint8_t sizeNibble( uint32_t size )
+    {
+        return size > 16 ? 15 : (size - 1) & 0xF;
+    }
+
+    // Repeats and long literal runs, which take the escape of the repeat offset
+    static inline uint32_t writeRepeat( uint8_t *outptr, struct seqEntry *entry, uint32_t base, uint8_t *input, uint32_t inputSize )
+    {
+        if (entry->size <= 16)
+            return writeOffset( outptr, base - entry->position );
+
+        uint32_t field = TURBOSQUEEZE_LONG_TOKEN | (entry->literals ? TURBOSQUEEZE_LONG_LITERALS : base - entry->position);
+
+        outptr[0] = 0;
+        outptr[1] = 0;
+        outptr[2] = field & 0xFF;
+        outptr[3] = (field >> 8) & 0xFF;
+        outptr[4] = (field >> 16) & 0xFF;
+
+        uint32_t i = 5 + writeLength( outptr+5, entry->size );
+
+        if (entry->literals)
+        {
+            copyLiterals( outptr+i, input, entry->position, entry->size, inputSize );
+            i += entry->size;
+        }
+
+        return i;
+    }
+
+    static uint32_t writeOutput( struct seqEntry *entryBuffer, uint32_t *entryPos, uint8_t *outptr, uint8_t *input, uint32_t inputSize, bool finalize, uint32_t processed )
+    {
+        uint8_t ctrl_byte = entryBuffer[0].repeat;
+        uint32_t i = 0;
+
+        for (uint32_t j=1; j<8; j++)
+        {
+            ctrl_byte = (ctrl_byte << 1) | entryBuffer[j].repeat;
+        }
+
+        outptr[i++] = ctrl_byte;
+
+        for (uint32_t j=0; j < 4 && ((j*2) < (*entryPos)); j++)
+        {
+            // Long tokens have their own length, their nibble is ignored
+            uint8_t size_byte = (sizeNibble( entryBuffer[j*2].size ) << 4) | sizeNibble( entryBuffer[j*2+1].size );
+
+            outptr[i++] = size_byte;
+
+            if (entryBuffer[j*2].repeat)
+            {
+                i += writeRepeat( &outptr[i], &entryBuffer[j*2], entryBuffer[j*2].base, input, inputSize );
+            }
+            else
+            {
+            	copyLiterals( &outptr[i], input, entryBuffer[j*2].position, entryBuffer[j*2].size, inputSize );
+                i += entryBuffer[j*2].size;
+            }
+
+            if (((j*2+1) < (*entryPos)))
+            {
+                if (entryBuffer[j*2+1].repeat)
+                {
+                    i += writeRepeat( &outptr[i], &entryBuffer[j*2+1], entryBuffer[j*2].base, input, inputSize );
+                }
+                else
+                {
+                	copyLiterals( &outptr[i], input, entryBuffer[j*2+1].position, entryBuffer[j*2+1].size, inputSize );
+                    i += entryBuffer[j*2+1].size;
+                }
+            }
+        }
+
+        if ((*entryPos) >= 8)
+            *entryPos -= 8;
+        else
+            *entryPos = 0;
+
+        if ((*entryPos) == 1)
+        {
+            entryBuffer[0].repeat = entryBuffer[8].repeat;
+            entryBuffer[0].literals = entryBuffer[8].literals;
+            entryBuffer[0].size = entryBuffer[8].size;
+            entryBuffer[0].position = entryBuffer[8].position;
+            entryBuffer[0].base = entryBuffer[8].base;
+
+            if (finalize)
+            {
+                i += writeOutput( entryBuffer, entryPos, outptr+i, input, inputSize, true, processed+i );
+            }
+        }
+
+        return i;
+    }
+
+    // Returns the size of the frame header, followed by the dictionary id when there is a dictionary
+    static uint32_t frameHeader( uint8_t *header, uint32_t block_bits, bool linked, uint32_t dict_size, uint32_t dict_id )
+    {
+        header[0] = 'T';
+        header[1] = 'S';
+        header[2] = 'Q';
+        header[3] = TURBOSQUEEZE_FRAME_VERSION;
+        header[4] = block_bits;
+        header[5] = (linked ? TURBOSQUEEZE_FRAME_LINKED : 0) | (dict_size ? TURBOSQUEEZE_FRAME_DICTIONARY : 0);
+
+        if (!dict_size) return TURBOSQUEEZE_FRAME_HEADER_SZ;
+
+        header[6] = (dict_id & 0xFF);
+        header[7] = ((dict_id >> 8) & 0xFF);
+        header[8] = ((dict_id >> 16) & 0xFF);
+        header[9] = ((dict_id >> 24) & 0xFF);
+
+        return TURBOSQUEEZE_FRAME_HEADER_SZ + TURBOSQUEEZE_DICT_ID_SZ;
+    }
+
+    bool ICompressor::writeFrameHeader( IWriter* writer )
+    {
+        uint8_t *header;
+        writer->getdest( (char**) &header, TURBOSQUEEZE_FRAME_HEADER_SZ + TURBOSQUEEZE_DICT_ID_SZ );
+
+        if (!header) return false;
+
+        writer->write( frameHeader( header, blockBits, linked, dictSize, dictId ) );
+
+        return true;
+    }
+
+    // Moves the end of the block at window+LINK_SZ in front of it, returns the new prefix size
+    static uint32_t keepLink( uint8_t *window, uint32_t prefix, uint32_t size )
+    {
+        uint32_t keep = prefix + size < TURBOSQUEEZE_LINK_SZ ? prefix + size : TURBOSQUEEZE_LINK_SZ;
+
+        memmove( window+TURBOSQUEEZE_LINK_SZ-keep, window+TURBOSQUEEZE_LINK_SZ+size-keep, keep );
+        return keep;
+    }
+
+    // Compression method
+    void ICompressor::compress(IReader* reader, IWriter* writer)
+    {
+    	if (reader == nullptr || writer == nullptr) return;
+
+        if (!writeFrameHeader( writer )) return;
+
+        if (nWorkers > 0)
+        {
+            compressParallel( reader, writer );
+            return;
+        }
+
+        // Linked blocks are copied after the end of the previous one, the reader may not keep it.
+        // With a dictionary, blocks are copied after the dictionary.
+        const bool windowed = linked || dictSize > 0;
+        uint32_t prefix = dictSize;
+        bool dictPrefix = true;
+
+        if (windowed && !loadWindow( &window, &windowBits, &windowLoaded, blockBits, dictionary, dictSize )) return;
+
+    	do
+        {
+            uint8_t *inbuff;
+            size_t i;
+
+            size_t input_sz = reader->read((char**) &inbuff, &i, TURBOSQUEEZE_BLOCK_SZ( blockBits ));
+
+            if (input_sz > 0)
+            {
+                uint8_t *outbuff;
+                writer->getdest( (char**) &outbuff, TURBOSQUEEZE_BLOCK_BOUND( input_sz ) );
+
+                if (!outbuff) break;
+
+                if (windowed)
+                {
+                    memcpy( window+TURBOSQUEEZE_LINK_SZ, inbuff+i, input_sz );
+                    writer->write( encodeBlock( window+TURBOSQUEEZE_LINK_SZ, outbuff, input_sz, prefix, dictPrefix ) );
+
+                    if (linked)
+                    {
+                        prefix = keepLink( window, prefix, input_sz );
+                        dictPrefix = false;
+                        windowLoaded = false;
+                    }
+                }
+                else
+                    writer->write( encodeBlock( inbuff+i, outbuff, input_sz ) );
+            }
+        }
+        while ( !reader->eof() ) ;
+    }
+
+    // Memory to memory: blocks are encoded in place in dst when the worst case fits, else through the scratch block
+    size_t ICompressor::compress( const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity )
+    {
+        if (src == nullptr || dst == nullptr) return 0;
+
+        // Large inputs go through the block pipeline
+        const uint32_t blockSize = TURBOSQUEEZE_BLOCK_SZ( blockBits );
+
+        if (nWorkers > 0 && srcSize > blockSize)
+        {
+            MemoryReader reader;
+            MemoryWriter writer;
+
+            reader.set( (char*) src, srcSize );
+            writer.set( (char*) dst, dstCapacity );
+            compress( &reader, &writer );
+
+            return writer.isOverflow() ? 0 : writer.getpos();
+        }
+
+        if (dstCapacity < TURBOSQUEEZE_FRAME_HEADER_SZ + TURBOSQUEEZE_DICT_ID_SZ) return 0;
+
+        size_t pos = frameHeader( dst, blockBits, linked, dictSize, dictId );
+
+        // Blocks are copied after the dictionary in the window, and linked blocks after the end of the previous one
+        uint32_t prefix = dictSize;
+        bool dictPrefix = dictSize > 0;
+
+        if (dictSize && !loadWindow( &window, &windowBits, &windowLoaded, blockBits, dictionary, dictSize )) return 0;
+
+        for (size_t i = 0; i < srcSize; i += blockSize)
+        {
+            uint32_t inputSize = srcSize - i < blockSize ? srcSize - i : blockSize;
+            size_t remaining = dstCapacity - pos;
+            uint8_t *inbuff = (uint8_t*) src+i;
+
+            // Without a dictionary, linked blocks see the end of the previous block in src
+            if (dictSize)
+            {
+                memcpy( window+TURBOSQUEEZE_LINK_SZ, inbuff, inputSize );
+                inbuff = window+TURBOSQUEEZE_LINK_SZ;
+            }
+            else if (linked)
+                prefix = i < TURBOSQUEEZE_LINK_SZ ? i : TURBOSQUEEZE_LINK_SZ;
+
+            if (remaining >= TURBOSQUEEZE_BLOCK_BOUND( inputSize ))
+            {
+                pos += encodeBlock( inbuff, dst+pos, inputSize, prefix, dictPrefix );
+            }
+            else
+            {
+                if (!scratch) scratch = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_OUTPUT_SZ( blockBits ) );
+                if (!scratch) return 0;
+
+                uint32_t outputSize = encodeBlock( inbuff, scratch, inputSize, prefix, dictPrefix );
+                if (outputSize > remaining) return 0;
+
+                memcpy( dst+pos, scratch, outputSize );
+                pos += outputSize;
+            }
+
+            if (dictSize && linked)
+            {
+                prefix = keepLink( window, prefix, inputSize );
+                dictPrefix = false;
+                windowLoaded = false;
+            }
+        }
+
+        return pos;
+    }
+
+    // Encodes one block with its compressed size header, returns the size written to outbuff
+    uint32_t ICompressor::encodeBlock( uint8_t *inbuff, uint8_t *outbuff, uint32_t inputSize, uint32_t prefix, bool dictPrefix )
+    {
+        uint32_t outputSize = 0;
+        encode( inbuff, outbuff+3, &outputSize, inputSize, prefix, dictPrefix );
+
+        // Blocks which do not shrink are stored, the decoder copies them
+        uint32_t stored = 0;
+
+        if (outputSize >= inputSize + 6)
+        {
+            outbuff[3] = (inputSize & 0xFF);
+            outbuff[4] = ((inputSize >> 8) & 0xFF);
+            outbuff[5] = ((inputSize >> 16) & 0xFF);
+            memcpy( outbuff+6, inbuff, inputSize );
+
+            outputSize = inputSize + 6;
+            stored = TURBOSQUEEZE_STORED;
+        }
+
+        outbuff[0] = (outputSize & 0xFF);
+        outbuff[1] = ((outputSize >> 8) & 0xFF);
+        outbuff[2] = (((outputSize | stored) >> 16) & 0xFF);
+
+        return outputSize;
+    }
+
+    void ICompressor::compressParallel(IReader* reader, IWriter* writer)
+    {
+        struct Job {
+            ICompressor *ctx;
+            uint8_t *input;
+            uint8_t *copy;
+            uint8_t *output;
+            uint32_t inputSize;
+            uint32_t outputSize;
+            uint32_t prefix;
+            bool dictPrefix;
+        };
+
+        const uint32_t nThreads = nWorkers + 1;
+        Job *jobs = new Job [nThreads];
+
+        // Linked blocks are copied after the end of the previous block, taken from the copy of the previous job.
+        // The dictionary is copied once in front of the blocks of every job.
+        const uint32_t linkSize = (linked || dictSize > 0) ? TURBOSQUEEZE_LINK_SZ : 0;
+        const bool persistent = reader->persistent() && linkSize == 0;
+
+        for (uint32_t k=0; k<nThreads; k++)
+        {
+            jobs[k].ctx = k == 0 ? this : workers[k-1];
+            jobs[k].copy = persistent ? nullptr : (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, linkSize + TURBOSQUEEZE_OUTPUT_SZ( blockBits ) );
+            jobs[k].output = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_OUTPUT_SZ( blockBits ) );
+            jobs[k].prefix = dictSize;
+            jobs[k].dictPrefix = dictSize > 0;
+
+            if (jobs[k].copy && dictSize) memcpy( jobs[k].copy + linkSize - dictSize, dictionary, dictSize );
+        }
+
+        {
+            BlockPipeline pipeline( nThreads, [jobs]( uint32_t k ) {
+                jobs[k].outputSize = jobs[k].ctx->encodeBlock( jobs[k].input, jobs[k].output, jobs[k].inputSize, jobs[k].prefix, jobs[k].dictPrefix );
+            } );
+
+            bool overflow = false;
+
+            // Blocks are written when their slot comes round again, so the output keeps the input order
+            auto flush = [&]( uint32_t k ) {
+                if (pipeline.wait( k ) && !overflow)
+                {
+                    uint8_t *outbuff;
+                    writer->getdest( (char**) &outbuff, jobs[k].outputSize );
+
+                    if (outbuff)
+                    {
+                        memcpy( outbuff, jobs[k].output, jobs[k].outputSize );
+                        writer->write( jobs[k].outputSize );
+                    }
+                    else
+                        overflow = true;
+                }
+            };
+
+            uint32_t block = 0;
+
+            do
+            {
+                uint8_t *inbuff;
+                size_t i;
+
+                uint32_t k = block % nThreads;
+                flush( k );
+
+                size_t input_sz = reader->read((char**) &inbuff, &i, TURBOSQUEEZE_BLOCK_SZ( blockBits ));
+
+                if (input_sz > 0)
+                {
+                    if (persistent)
+                        jobs[k].input = (uint8_t*) inbuff+i;
+                    else
+                    {
+                        jobs[k].input = jobs[k].copy + linkSize;
+                        memcpy( jobs[k].input, inbuff+i, input_sz );
+                    }
+
+                    if (linked && block > 0)
+                    {
+                        Job &previous = jobs[(block-1) % nThreads];
+                        uint32_t prefix = previous.prefix + previous.inputSize;
+
+                        jobs[k].prefix = prefix < linkSize ? prefix : linkSize;
+                        jobs[k].dictPrefix = false;
+                        memcpy( jobs[k].input - jobs[k].prefix, previous.input + previous.inputSize - jobs[k].prefix, jobs[k].prefix );
+                    }
+
+                    jobs[k].inputSize = input_sz;
+                    pipeline.submit( k );
+                    block++;
+                }
+            }
+            while ( !reader->eof() && !overflow ) ;
+
+            for (uint32_t n=0; n<nThreads; n++)
+                flush( (block+n) % nThreads );
+        }
+
+        for (uint32_t k=0; k<nThreads; k++)
+        {
+            if (jobs[k].copy) align_free( jobs[k].copy );
+            align_free( jobs[k].output );
+        }
+
+        delete [] jobs;
+    }
+
+    bool ICompressor::findHit( uint8_t *input, uint32_t i, uint32_t base, uint32_t size, bool indexed, uint32_t &hitlength, uint32_t &hitpos )
+    {
+        bool hit = addHit( input, i, base, size, true, hitlength, hitpos );
+        if (!hit && indexed) hit = dictHit( input, i, base, size, hitlength, hitpos );
+        if (hit && hitlength == 16) hitlength = extendMatch( input, hitpos, i, size );
+        return hit && validHit( hitpos, hitlength, base, i );
+    }
+
+    static inline uint32_t lengthBytes( uint32_t length )
+    {
+        uint32_t value = length - 17;
+        uint32_t n = 1;
+
+        while (value >= 0x80)
+        {
+            value >>= 7;
+            n++;
+        }
+
+        return n;
+    }
+
+    static inline uint32_t repeatCost( uint32_t length, uint32_t offset )
+    {
+        if (length > 16)
+            return 8*(5 + lengthBytes( length )) + TURBOSQUEEZE_TOKEN_COST;
+
+        return 8*(offset < TURBOSQUEEZE_WINDOW_SZ ? 2 : 5) + TURBOSQUEEZE_TOKEN_COST;
+    }
+
+    // Eighths of a byte saved by a match, offset is the one it is encoded with
+    static inline int32_t matchGain( uint32_t length, uint32_t offset )
+    {
+        return (int32_t) (8*length) - (int32_t) repeatCost( length, offset );
+    }
+
+    // A token from an even state leads to an odd one, and the other way around
+    static inline void relaxToken( ParseNode *nodes, uint32_t p, uint32_t length, uint32_t position, uint32_t cost, bool odd )
+    {
+        ParseNode *node = &nodes[p + length];
+
+        if (odd && cost < node->evenCost)
+        {
+            node->evenCost = cost;
+            node->evenLength = length;
+            node->evenPosition = position;
+        }
+        else if (!odd && cost < node->oddCost)
+        {
+            node->oddCost = cost;
+            node->oddLength = length;
+            node->oddPosition = position;
+        }
+    }
+
+    // Forward pass over the block with the match at every position and all its shorter lengths, then the cheapest
+    // path is walked back. The offsets of a pair are relative to its first token, so the states keep the pair parity.
+    void ICompressor::parseOptimal( uint8_t *input, uint32_t prefix, uint32_t size, bool indexed )
+    {
+        if (parseSize < size + 1)
+        {
+            delete [] parseNodes;
+            parseNodes = new ParseNode[size + 1];
+            parseSize = size + 1;
+        }
+
+        ParseNode *nodes = parseNodes;
+
+        for (uint32_t p = prefix; p <= size; p++)
+        {
+            nodes[p].evenCost = UINT32_MAX;
+            nodes[p].oddCost = UINT32_MAX;
+        }
+
+        nodes[prefix].evenCost = 0;
+
+        // Long match of the previous position, one byte shorter from the next source at this one
+        uint32_t longlength = 0;
+        uint32_t longpos = 0;
+        uint32_t checked = 0;
+
+        // Cheapest start of a long literal run in each state, its cost only grows by a byte per literal
+        uint32_t runStart[2] = { UINT32_MAX, UINT32_MAX };
+
+        for (uint32_t p = prefix; p <= size; p++)
+        {
+            uint32_t hitlength = 0;
+            uint32_t hitpos = 0;
+
+            // Long literal runs ending here, the end of the block included, from the cheapest start at least
+            // LONG_MIN bytes back
+            if (p >= prefix + TURBOSQUEEZE_LONG_MIN)
+            {
+                uint32_t s = p - TURBOSQUEEZE_LONG_MIN;
+
+                for (uint32_t odd = 0; odd < 2; odd++)
+                {
+                    uint32_t cost = odd ? nodes[s].oddCost : nodes[s].evenCost;
+                    uint32_t start = runStart[odd];
+
+                    if (start != UINT32_MAX)
+                    {
+                        uint32_t startCost = odd ? nodes[start].oddCost : nodes[start].evenCost;
+                        if ((uint64_t) cost + 8*(p - s) < (uint64_t) startCost + 8*(p - start))
+                            start = UINT32_MAX;
+                    }
+
+                    if (start == UINT32_MAX && cost != UINT32_MAX) start = s;
+                    runStart[odd] = start;
+
+                    if (start == UINT32_MAX) continue;
+
+                    uint32_t length = p - start;
+                    uint32_t startCost = odd ? nodes[start].oddCost : nodes[start].evenCost;
+                    relaxToken( nodes, start, length, TURBOSQUEEZE_PARSE_LITERALS, startCost + 8*(5 + lengthBytes( length ) + length) + TURBOSQUEEZE_TOKEN_COST, odd );
+                }
+            }
+
+            if (p == size) break;
+
+            longlength = longlength > TURBOSQUEEZE_LONG_MIN ? longlength - 1 : 0;
+            longpos++;
+
+            bool carried = longlength > 0;
+            bool hit = addHit( input, p, p, size, !carried, hitlength, hitpos );
+            if (!hit && indexed) hit = dictHit( input, p, p, size, hitlength, hitpos );
+
+            // Runs are carried over instead of extended again at every position, which is quadratic on zero pages.
+            // The match found here still gives the short lengths, its offset may be nearer. Another offset may
+            // also start a longer run, each one is extended once while the run is carried.
+            if (hit && hitlength >= 16 && (!carried || (hitpos != longpos && p - hitpos != checked)))
+            {
+                uint32_t length = hitlength == 16 ? extendMatch( input, hitpos, p, size ) : hitlength;
+
+                if (length > 16 && length > longlength)
+                {
+                    longlength = length;
+                    longpos = hitpos;
+                    carried = false;
+                }
+                else if (carried)
+                    checked = p - hitpos;
+
+                hitlength = length;
+            }
+
+            uint32_t shortlength = hit ? (hitlength < 16 ? hitlength : 16) : 0;
+
+            for (uint32_t odd = 0; odd < 2; odd++)
+            {
+                uint32_t cost = odd ? nodes[p].oddCost : nodes[p].evenCost;
+                if (cost == UINT32_MAX) continue;
+
+                uint32_t base = odd ? p - nodes[p].oddLength : p;
+
+                for (uint32_t length = 1; length <= 16 && p + length <= size; length++)
+                    relaxToken( nodes, p, length, TURBOSQUEEZE_PARSE_LITERALS, cost + 8*length + TURBOSQUEEZE_TOKEN_COST, odd );
+
+                for (uint32_t length = 4; length <= shortlength; length++)
+                    if (validHit( hitpos, length, base, p ))
+                        relaxToken( nodes, p, length, hitpos, cost + repeatCost( length, base - hitpos ), odd );
+
+                if (longlength <= 16 || !validHit( longpos, longlength, base, p )) continue;
+
+                // Every length of a long match from the start of its run, the positions it carries on to only take
+                // the whole match. The run is searched once, and the parse may still end it at any position.
+                for (uint32_t length = carried ? longlength : 17; length <= longlength; length++)
+                    relaxToken( nodes, p, length, longpos, cost + repeatCost( length, base - longpos ), odd );
+            }
+        }
+
+        uint32_t p = size;
+        bool odd = nodes[size].oddCost < nodes[size].evenCost;
+
+        while (p > prefix)
+        {
+            uint32_t length = odd ? nodes[p].oddLength : nodes[p].evenLength;
+
+            p -= length;
+            odd = !odd;
+
+            nodes[p].length = length;
+        }
+    }
+
+    // The prefix bytes before inputBlock are the end of the previous block, in linked mode
+    void ICompressor::encode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize, uint32_t prefix, bool dictPrefix )
+    {
+        // First write the uncompressed size
+        outputBlock[0] = (inputSize & 0xFF);
+        outputBlock[1] = ((inputSize >> 8) & 0xFF);
+        outputBlock[2] = ((inputSize >> 16) & 0xFF);
+
+        *outputSize = 3;
+
+        inputBlock -= prefix;
+        const uint32_t size = prefix + inputSize;
+
+        init( size );
+
+        // A prefix made of the dictionary alone, every block or the first linked one, is searched through the dictionary
+        // table. The previous block only fills the tables, even when it is as long as the dictionary.
+        const bool indexed = dictIndex != nullptr && dictPrefix;
+        const bool lazy = getLevel() >= TURBOSQUEEZE_LAZY_LEVEL;
+
+        for (uint32_t p = indexed ? prefix : 0; p < prefix; p++)
+        {
+            uint32_t hitlength, hitpos;
+            addHit( inputBlock, p, p, size, false, hitlength, hitpos );
+        }
+
+        uint32_t entryPos = 0;
+        struct seqEntry entryBuffer[9] = {};
+
+        uint32_t i = prefix;
+        uint32_t j = 3;
+        uint32_t last_i = i;
+        uint32_t rep_last_i = i;
+        uint8_t *outptr = outputBlock;
+        bool escapes = false;
+
+        static uint32_t block;
+
+        // The ultra level takes the tokens of the optimal parse, its pairs start where the parse expected them
+        if (getLevel() >= ULTRA_LEVEL)
+        {
+            parseOptimal( inputBlock, prefix, size, indexed );
+
+            while (i < size && j < inputSize + 3)
+            {
+                // The second token of a pair starts in an odd state and ends in an even one
+                uint32_t length = parseNodes[i].length;
+                uint32_t position = (entryPos & 1) ? parseNodes[i+length].evenPosition : parseNodes[i+length].oddPosition;
+                bool literals = position == TURBOSQUEEZE_PARSE_LITERALS;
+
+                escapes |= length > 16 || (!literals && rep_last_i - position >= TURBOSQUEEZE_WINDOW_SZ);
+
+                // Long literal runs take a long token
+                entryBuffer[entryPos].repeat = !literals || length > 16;
+                entryBuffer[entryPos].literals = literals;
+                entryBuffer[entryPos].size = length;
+                entryBuffer[entryPos].position = literals ? i : position;
+                entryBuffer[entryPos].base = rep_last_i;
+                entryPos++;
+
+                i += length;
+
+                if ((entryPos & 1) == 0)
+                    rep_last_i = i;
+
+                if (entryPos >= 8)
+                    j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, size, false, j );
+            }
+        }
+
+        // Once the output is as large as the input the block will be stored, the rest is not encoded
+        while (i < size && j < inputSize + 3)
+        {
+            bool hit = false;
+            uint32_t hitlength = -1;
+            uint32_t hitpos = -1;
+
+            last_i = i;
+
+            // Base of the pair of the next repeat, as if the literals were cut in 16 byte tokens
+            uint32_t base = rep_last_i;
+
+            // Positions skipped by the acceleration are neither searched nor added to the tables
+            uint32_t attempts = acceleration << TURBOSQUEEZE_SKIP_TRIGGER;
+
+            // Count Litteral characters until the next match
+            while (i < size)
+            {
+                uint32_t tokens = (i-last_i) / 16;
+
+                if (tokens > 0 && ((entryPos + tokens) & 1) == 0)
+                    base = last_i + tokens*16;
+
+                hit = findHit( inputBlock, i, base, size, indexed, hitlength, hitpos );
+                if (hit) break;
+
+                uint32_t step = acceleration ? attempts++ >> TURBOSQUEEZE_SKIP_TRIGGER : 1;
+                i = i + step < size ? i + step : size;
+            }
+
+            // Lazy parse: one more literal pays off when the match at the next position saves more than it costs.
+            // A long match taken that way ends the search, it is not traded again for one a byte further.
+            while (hit && lazy && i + 1 < size)
+            {
+                uint32_t next = i + 1;
+                uint32_t nextbase = base;
+                uint32_t nextlength, nextpos;
+
+                if (((next-last_i) & 15) == 0 && ((entryPos + (next-last_i)/16) & 1) == 0)
+                    nextbase = next;
+
+                if (!findHit( inputBlock, next, nextbase, size, indexed, nextlength, nextpos )) break;
+
+                // The extra literal costs its byte, and a token when it does not fit in the current one
+                uint32_t literals = i - last_i;
+                int32_t literalCost = 8 + ((literals & 15) == 0 && literals < TURBOSQUEEZE_LONG_MIN ? TURBOSQUEEZE_TOKEN_COST : 0);
+
+                if (matchGain( nextlength, nextbase - nextpos ) - literalCost <= matchGain( hitlength, base - hitpos )) break;
+
+                i = next;
+                base = nextbase;
+                hitlength = nextlength;
+                hitpos = nextpos;
+
+                if (hitlength >= TURBOSQUEEZE_LONG_MIN) break;
+            }
+
+            // Litterals, a long run takes a single token
+            if ((i-last_i) >= TURBOSQUEEZE_LONG_MIN)
+            {
+                escapes = true;
+
+                entryBuffer[entryPos].repeat = true;
+                entryBuffer[entryPos].literals = true;
+                entryBuffer[entryPos].size = i-last_i;
+                entryBuffer[entryPos].position = last_i;
+                entryBuffer[entryPos].base = rep_last_i;
+                entryPos++;
+
+                if ((entryPos & 1) == 0)
+                    rep_last_i = i;
+
+                // The repeat may be in a pair starting before the run
+                hit = hit && validHit( hitpos, hitlength, rep_last_i, i );
+            }
+            else
+            {
+                for (uint32_t position = last_i; position < i; position += 16)
+                {
+                    entryBuffer[entryPos].repeat = false;
+                    entryBuffer[entryPos].literals = true;
+                    entryBuffer[entryPos].size = i-position < 16 ? i-position : 16;
+                    entryBuffer[entryPos].position = position;
+                    entryBuffer[entryPos].base = rep_last_i;
+                    entryPos++;
+
+                    if ((entryPos & 1) == 0)
+                        rep_last_i = position + entryBuffer[entryPos-1].size;
+
+                    if (entryPos >= 8)
+                        j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, size, false, j );
+                }
+            }
+
+            // Repeat
+            if (hit)
+            {
+                escapes |= hitlength > 16 || rep_last_i - hitpos >= TURBOSQUEEZE_WINDOW_SZ;
+
+                entryBuffer[entryPos].repeat = true;
+                entryBuffer[entryPos].literals = false;
+                entryBuffer[entryPos].size = hitlength;
+                entryBuffer[entryPos].position = hitpos;
+                entryBuffer[entryPos].base = rep_last_i;
+
+                entryPos++;
+
+                i += hitlength;
+
+                if ((entryPos & 1) == 0)
                     rep_last_i = i;
             }
 
-            // Repeat
-            if (hit)
+            // Write output/flush?
+            if (entryPos >= 8)
+            {
+                j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, size, false, j );
+            }
+        }
+
+        // Finalize stream
+        j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, size, true, j );
+
+        // Blocks with escapes are sent to the scalar decoder, the SIMD ones only see 16 bit offsets and short tokens
+        if (escapes) outputBlock[2] |= TURBOSQUEEZE_ESCAPES >> 16;
+
+        *outputSize += j;
+    }
+
+    // Multiplicative hash of the 4 bytes, for a table of 1<<bits buckets
+    static inline uint32_t getHash( uint32_t h, uint32_t bits )
+    {
+        return (h * 2654435761u) >> (32-bits);
+    }
+
+    // Tables are sized to 4 buckets per input byte so small inputs only touch a small part of them
+    static inline uint32_t getHashBits( uint32_t inputSize, uint32_t maxBits )
+    {
+        uint32_t bits = TURBOSQUEEZE_MIN_HASH_BITS;
+        while (bits < maxBits && (1u << bits) < inputSize) bits++;
+        return bits;
+    }
+
+    static inline uint32_t matchlen( uint8_t *inbuff, uint32_t first, uint32_t second, uint32_t decoded_size, uint32_t size )
+    {
+        uint32_t maxmatchstrlen = 16;
+
+        // Positions past the base of the pair are not usable
+        if (first >= decoded_size) return 0;
+
+        maxmatchstrlen = (first+maxmatchstrlen < decoded_size) ? maxmatchstrlen : decoded_size-first;
+        maxmatchstrlen = (second+maxmatchstrlen) < size ? maxmatchstrlen : size - second;
+        maxmatchstrlen = (second-first) < maxmatchstrlen ? second-first : maxmatchstrlen;
+
+        if (maxmatchstrlen >= 4)
+        {
+        #if TURBOSQUEEZE_SSE2 || TURBOSQUEEZE_ARM64
+            // One 16 byte compare, the first mismatch past the 4 hashed bytes is capped by the length limit
+            if (second + 16 <= size)
+            {
+            #if TURBOSQUEEZE_SSE2
+                uint32_t equal = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (__m128i*) (inbuff+first) ), _mm_loadu_si128( (__m128i*) (inbuff+second) ) ) );
+                uint64_t mismatch = (~equal & 0xFFF0) | (1 << maxmatchstrlen);
+
+                return turbosqueeze_ctz( mismatch );
+            #else
+                // 4 bits per byte since there is no movemask
+                uint8x16_t equal = vceqq_u8( vld1q_u8( inbuff+first ), vld1q_u8( inbuff+second ) );
+                uint64_t nibbles = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( equal ), 4 ) ), 0 );
+                uint64_t mismatch = (~nibbles & 0xFFFFFFFFFFFF0000ull) | (maxmatchstrlen < 16 ? 1ull << (4*maxmatchstrlen) : 0);
+
+                return mismatch ? turbosqueeze_ctz( mismatch ) / 4 : 16;
+            #endif
+            }
+        #endif
+
+            uint32_t i = 4;
+            uint8_t *strfirst = inbuff+first;
+            uint8_t *strsecond = inbuff+second;
+
+            while ((i < maxmatchstrlen) && (strfirst[i] == strsecond[i])) i++;
+
+            return i;
+        }
+        else
+            return 0;
+    }
+
+    // Last position of each hashed 4 bytes of the dictionary, plus one
+    void ICompressor::indexDictionary()
+    {
+        delete [] dictIndex;
+        dictIndex = nullptr;
+
+        if (dictSize < 4) return;
+
+        dictIndexBits = getHashBits( dictSize*2, TURBOSQUEEZE_REFHASH_BITS );
+        dictIndex = new uint32_t [1u << dictIndexBits]();
+
+        for (uint32_t p=0; p+3<dictSize; p++)
+            dictIndex[getHash( *((uint32_t*) (dictionary+p)), dictIndexBits )] = p+1;
+    }
+
+    // Match in the dictionary at the start of input, when the tables of the block have none
+    bool ICompressor::dictHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos )
+    {
+        if (i + 3 < size)
+        {
+            uint32_t str4 = *((uint32_t*) (input+i));
+            uint32_t position = dictIndex[getHash( str4, dictIndexBits )];
+
+            if (position-- == 0 || *((uint32_t*) (input+position)) != str4 || i - position >= TURBOSQUEEZE_FAR_WINDOW_SZ) return false;
+
+            uint32_t matchlength = matchlen( input, position, i, decoded_size, size );
+
+            if (matchlength >= 4 && usableMatch( i - position, matchlength ))
+            {
+                hitlength = matchlength;
+                hitpos = position;
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    FastCompressor::FastCompressor( uint32_t compression_level ) : ICompressor( compression_level )
+    {
+        acceleration = DEFAULT_ACCELERATION;
+        refhash = (FastCompressor::RefBucket*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_BUCKET_SZ*sizeof(FastCompressor::RefBucket) );
+        if (refhash != nullptr) memset( refhash, 0, TURBOSQUEEZE_BUCKET_SZ*sizeof(FastCompressor::RefBucket) );
+        generation = 0;
+        hashBits = TURBOSQUEEZE_BUCKET_BITS;
+        dirtyBuckets = 0;
+    }
+
+    FastCompressor::~FastCompressor()
+    {
+        if (refhash != nullptr) align_free(refhash);
+    }
+
+    // A new block only bumps the generation, the buckets used since the last clear are cleared once every 31 blocks
+    void FastCompressor::init( uint32_t inputSize )
+    {
+        if (++generation == TURBOSQUEEZE_GENERATIONS)
+        {
+            memset( refhash, 0, dirtyBuckets*sizeof(FastCompressor::RefBucket) );
+            generation = 1;
+            dirtyBuckets = 0;
+        }
+
+        // One bucket of 7 symbols per 4 input bytes
+        hashBits = getHashBits( inputSize/4, TURBOSQUEEZE_BUCKET_BITS );
+        if (dirtyBuckets < (1u << hashBits)) dirtyBuckets = 1u << hashBits;
+    }
+
+    // Slot of str4 among the count first symbols of the bucket, count when it is not there
+    static inline uint32_t findSymbol( const uint32_t *sym4, uint32_t count, uint32_t str4 )
+    {
+    #if TURBOSQUEEZE_SSE2
+        __m128i key = _mm_set1_epi32( (int) str4 );
+        uint32_t low = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_load_si128( (__m128i*) sym4 ), key ) ) );
+        uint32_t high = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_load_si128( (__m128i*) (sym4+4) ), key ) ) );
+        uint32_t found = (low | (high << 4)) & ((1u << count) - 1);
+
+        return found ? turbosqueeze_ctz( found ) : count;
+    #elif TURBOSQUEEZE_ARM64
+        // One byte per symbol since there is no movemask
+        uint32x4_t key = vdupq_n_u32( str4 );
+        uint16x8_t equal = vcombine_u16( vmovn_u32( vceqq_u32( vld1q_u32( sym4 ), key ) ), vmovn_u32( vceqq_u32( vld1q_u32( sym4+4 ), key ) ) );
+        uint64_t found = vget_lane_u64( vreinterpret_u64_u8( vmovn_u16( equal ) ), 0 ) & ((1ull << (8*count)) - 1);
+
+        return found ? turbosqueeze_ctz( found ) / 8 : count;
+    #else
+        uint32_t j = 0;
+        while (j < count && sym4[j] != str4) j++;
+        return j;
+    #endif
+    }
+
+    bool FastCompressor::addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, bool extend, uint32_t &hitlength, uint32_t &hitpos)
+    {
+        if (i + 3 < size)
+        {
+            uint32_t str4 = *((uint32_t*) (input+i));
+            struct RefBucket *bucket = &refhash[getHash( str4, hashBits )];
+
+            if (i + TURBOSQUEEZE_BUCKET_PREFETCH + 3 < size)
+                turbosqueeze_prefetch( &refhash[getHash( *((uint32_t*) (input+i+TURBOSQUEEZE_BUCKET_PREFETCH)), hashBits )] );
+            uint32_t count = turbosqueeze_bucket_count( bucket->count, generation );
+            uint32_t j = findSymbol( bucket->sym4, count, str4 );
+
+            if (j < count)
+            {
+                uint32_t distance = i - bucket->latest_pos[j];
+
+                if (distance >= TURBOSQUEEZE_FAR_WINDOW_SZ)
+                {
+                    bucket->latest_pos[j] = i;
+                    return false;
+                }
+
+                uint32_t matchlength = matchlen( input, bucket->latest_pos[j], i, decoded_size, size );
+
+                if (matchlength >= 4 && usableMatch( distance, matchlength ))
+                {
+                    hitlength = matchlength;
+                    hitpos = bucket->latest_pos[j];
+
+                    bucket->latest_pos[j] = i;
+
+                    return true;
+                }
+
+                // Hit sym, a far position with a short match is moved to this one
+                if (distance >= TURBOSQUEEZE_WINDOW_SZ)
+                {
+                    bucket->latest_pos[j] = i;
+                    return false;
+                }
+            }
+            else if (j < TURBOSQUEEZE_REFHASH_ENTITIES)
+            {
+                // New sym
+                bucket->sym4[j] = str4;
+                bucket->latest_pos[j] = i;
+
+                bucket->count = (generation << 3) | (count+1);
+            }
+            else
+            {
+                // Full bucket, a sym out of the offset range leaves its entry to the new one
+                for (j=0; j<TURBOSQUEEZE_REFHASH_ENTITIES; j++)
+                {
+                    if (i - bucket->latest_pos[j] >= TURBOSQUEEZE_WINDOW_SZ)
+                    {
+                        bucket->sym4[j] = str4;
+                        bucket->latest_pos[j] = i;
+                        break;
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
+
+    FastNCompressor::FastNCompressor( uint32_t c_level ) : ICompressor( levelDepth( c_level ) ), level( c_level )
+    {
+        head = (uint32_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_REFHASH_PLUS_SZ*sizeof(uint32_t) );
+        if (head != nullptr) memset( head, 0, TURBOSQUEEZE_REFHASH_PLUS_SZ*sizeof(uint32_t) );
+        chain = nullptr;
+        hashBits = TURBOSQUEEZE_REFHASH_PLUS_BITS;
+        chainBits = 0;
+        dirtyBuckets = 0;
+        base = 0;
+        nextBase = 0;
+    }
+
+    FastNCompressor::~FastNCompressor()
+    {
+        if (head != nullptr) align_free(head);
+        if (chain != nullptr) align_free(chain);
+    }
+
+    void FastNCompressor::init( uint32_t inputSize )
+    {
+        // The heads are cleared when the bases would overflow
+        if (nextBase > UINT32_MAX - inputSize - 1)
+        {
+            memset( head, 0, dirtyBuckets*sizeof(uint32_t) );
+            nextBase = 0;
+            dirtyBuckets = 0;
+        }
+
+        base = nextBase;
+        nextBase = base + inputSize + 1;
+
+        hashBits = getHashBits( inputSize*4, TURBOSQUEEZE_REFHASH_PLUS_BITS );
+        if (dirtyBuckets < (1u << hashBits)) dirtyBuckets = 1u << hashBits;
+
+        // The chain only grows, its entries are written before they are read
+        uint32_t bits = getHashBits( inputSize, TURBOSQUEEZE_CHAIN_BITS );
+
+        if (bits > chainBits)
+        {
+            if (chain != nullptr) align_free(chain);
+            chain = (uint32_t*) align_alloc( MAX_CACHE_LINE_SIZE, (1u << bits)*sizeof(uint32_t) );
+            chainBits = bits;
+        }
+    }
+
+    bool FastNCompressor::addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, bool extend, uint32_t &hitlength, uint32_t &hitpos)
+    {
+        if (i + 3 >= size) return false;
+
+        uint32_t str4 = *((uint32_t*) (input+i));
+        uint32_t hsh = getHash( str4, hashBits );
+        uint32_t chainMask = (1u << chainBits) - 1;
+        uint32_t entry = head[hsh];
+        uint32_t maxmatchlength = 0;
+        uint32_t maxmatchpos = 0;
+        uint32_t maxscore = 0;
+        uint32_t previous = i;
+        uint32_t near = 0;
+
+        // Newest positions first, ties keep the nearest one. The chain ends at older blocks, at positions whose link
+        // was overwritten and out of the offset range, and where a position searched twice links to itself.
+        for (uint32_t k=0; k<compressionLevel && entry > base; )
+        {
+            uint32_t candidate = entry - base - 1;
+
+            if (candidate >= previous || i - candidate > chainMask) break;
+            entry = chain[candidate & chainMask];
+            previous = candidate;
+
+            // Up to 32 candidates too near the pair base for a 16 byte token are not counted, or the short depths of
+            // the fast levels would stop inside runs where all of them are
+            if (candidate + 16 <= decoded_size || ++near > 32) k++;
+
+            if (*((uint32_t*) (input+candidate)) != str4) continue;
+
+            uint32_t matchlength = matchlen( input, candidate, i, decoded_size, size );
+            uint32_t distance = decoded_size - candidate;
+
+            if (matchlength < 4 || !usableMatch( distance, matchlength )) continue;
+
+            // The candidates reaching 16 bytes are told apart by their extended length, the newest one is not
+            // always the longest
+            if (extend && matchlength == 16) matchlength = extendMatch( input, candidate, i, size );
+
+            // A far match pays 3 more offset bytes
+            uint32_t score = distance < TURBOSQUEEZE_WINDOW_SZ ? matchlength : matchlength - 3;
+
+            if (score > maxscore)
+            {
+                maxscore = score;
+                maxmatchlength = matchlength;
+                maxmatchpos = candidate;
+
+                if (!extend && maxmatchlength == 16 && distance < TURBOSQUEEZE_WINDOW_SZ) break;
+            }
+        }
+
+        chain[i & chainMask] = head[hsh];
+        head[hsh] = base + i + 1;
+
+        if (maxmatchlength < 4) return false;
+
+        hitlength = maxmatchlength;
+        hitpos = maxmatchpos;
+
+        return true;
+    }
+
+    // Decompressor
+    static bool isLittleEndian()
+    {
+    #if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        return true;
+    #elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        return false;
+    #elif defined(__clang__) && __LITTLE_ENDIAN__
+        return true;
+    #elif defined(__clang__) && __BIG_ENDIAN__
+        return false;
+    #elif defined(_MSC_VER) && (_M_AMD64 || _M_IX86)
+        return true;
+    #elif defined(__DMC__) && defined(_M_IX86)
+        return true;
+    #else
+        static union { uint32_t u; uint8_t c[4]; } one = { 1 };
+        return one.c[0] != 0;
+    #endif
+    }
+
+    #if TURBOSQUEEZE_X86
+    // CPU features selecting the SIMD kernels at run time
+    enum {
+        CPU_SSE41 = 1,
+        CPU_AVX2 = 2,
+        CPU_AVX512 = 4
+    };
+
+    static uint32_t detectCpuFeatures()
+    {
+        uint32_t features = 0;
+        uint32_t regs[4];
+
+    #if _MSC_VER
+        #define turbosqueeze_cpuid( R, L ) __cpuidex( (int*) (R), L, 0 )
+    #else
+        #define turbosqueeze_cpuid( R, L ) __cpuid_count( L, 0, (R)[0], (R)[1], (R)[2], (R)[3] )
+    #endif
+
+        turbosqueeze_cpuid( regs, 0 );
+        uint32_t maxLeaf = regs[0];
+
+        if (maxLeaf >= 1)
+        {
+            turbosqueeze_cpuid( regs, 1 );
+
+            if (regs[2] & (1 << 19)) features |= CPU_SSE41;
+
+            // The OS must save the ymm/zmm registers (OSXSAVE, then XCR0)
+            if ((regs[2] & (1 << 27)) && maxLeaf >= 7)
             {
-                entryBuffer[entryPos].repeat = true;
-                entryBuffer[entryPos].size = hitlength;
-                entryBuffer[entryPos].position = hitpos;
-                entryBuffer[entryPos].base = rep_last_i;
+            #if _MSC_VER
+                uint64_t xcr0 = _xgetbv( 0 );
+            #else
+                uint32_t xcr0lo, xcr0hi;
+                __asm__ __volatile__ ( "xgetbv" : "=a" (xcr0lo), "=d" (xcr0hi) : "c" (0) );
+                uint64_t xcr0 = ((uint64_t) xcr0hi << 32) | xcr0lo;
+            #endif
+
+                turbosqueeze_cpuid( regs, 7 );
+
+                if ((xcr0 & 0x06) == 0x06 && (regs[1] & (1 << 5)))
+                    features |= CPU_AVX2;
+
+                // AVX-512 F, BW and VL
+                if ((xcr0 & 0xE6) == 0xE6 && (regs[1] & (1 << 16)) && (regs[1] & (1u << 30)) && (regs[1] & (1u << 31)))
+                    features |= CPU_AVX512;
+            }
+        }
 
-                entryPos++;
+        #undef turbosqueeze_cpuid
+
+        return features;
+    }
+
+    static uint32_t cpuFeatures()
+    {
+        static const uint32_t features = detectCpuFeatures();
+        return features;
+    }
+    #endif
+
+    class LittleEndianDecompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+    };
+
+    class BigEndianDecompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+    };
+
+    class AVX2Decompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override { return 8; }
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
+    };
+
+    class AVX512Decompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override;
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
+    };
+
+    class NEONDecompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override { return 8; }
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
+    };
+
+    IDecompressor* DecompressorFactory( uint32_t n_threads, bool interleaved )
+    {
+        IDecompressor* decompressor;
+
+        if (!isLittleEndian())
+            decompressor = new BigEndianDecompressor();
+    #if TURBOSQUEEZE_X86
+        else if (cpuFeatures() & CPU_AVX512)
+            decompressor = new AVX512Decompressor();
+        else if (cpuFeatures() & CPU_AVX2)
+            decompressor = new AVX2Decompressor();
+    #endif
+    #if TURBOSQUEEZE_ARM64
+        else
+            decompressor = new NEONDecompressor();
+    #else
+        else
+            decompressor = new LittleEndianDecompressor();
+    #endif
+
+        if (decompressor)
+        {
+            decompressor->setThreads( n_threads );
+            decompressor->setInterleaved( interleaved );
+        }
+        return decompressor;
+    }
+
+    void DecompressorDestroy( IDecompressor* decompressor )
+    {
+        delete decompressor;
+    }
+
+    IDecompressor::~IDecompressor()
+    {
+        if (window) align_free( window );
+        delete [] dictionary;
+    }
+
+    void IDecompressor::setDictionary( const uint8_t* dict, size_t size )
+    {
+        copyDictionary( &dictionary, &dictSize, &dictId, dict, size );
+        windowLoaded = false;
+    }
+
+    size_t compressBound( size_t inputSize )
+    {
+        // Counted with the smallest blocks, so the bound holds for every block size
+        size_t blocks = (inputSize + TURBOSQUEEZE_BLOCK_SZ( MIN_BLOCK_BITS ) - 1) / TURBOSQUEEZE_BLOCK_SZ( MIN_BLOCK_BITS );
+        return TURBOSQUEEZE_FRAME_HEADER_SZ + TURBOSQUEEZE_DICT_ID_SZ + inputSize + inputSize/16 + blocks*64;
+    }
+
+    size_t compress( const char* src, size_t srcSize, char* dst, size_t dstCapacity, uint32_t compression_level )
+    {
+        ICompressor* compressor = CompressorFactory( compression_level );
+        size_t size = compress( compressor, src, srcSize, dst, dstCapacity );
+        CompressorDestroy( compressor );
+        return size;
+    }
+
+    size_t compress( ICompressor* compressor, const char* src, size_t srcSize, char* dst, size_t dstCapacity )
+    {
+        return compressor ? compressor->compress( (const uint8_t*) src, srcSize, (uint8_t*) dst, dstCapacity ) : 0;
+    }
+
+    size_t decompress( const char* src, size_t srcSize, char* dst, size_t dstCapacity )
+    {
+        IDecompressor* decompressor = DecompressorFactory();
+        size_t size = decompress( decompressor, src, srcSize, dst, dstCapacity );
+        DecompressorDestroy( decompressor );
+        return size;
+    }
+
+    size_t decompress( IDecompressor* decompressor, const char* src, size_t srcSize, char* dst, size_t dstCapacity )
+    {
+        return decompressor ? decompressor->decompress( (const uint8_t*) src, srcSize, (uint8_t*) dst, dstCapacity ) : 0;
+    }
+
+    // Streams written before the frame header start with a block header, whose compressed size can not spell "TSQ".
+    // Returns true for a frame header, blockBits is then 0 when the stream can not be decoded.
+    bool IDecompressor::readFrameHeader( const uint8_t *header )
+    {
+        blockBits = DEFAULT_BLOCK_BITS;
+        linked = false;
+        primed = false;
+
+        if (header[0] != 'T' || header[1] != 'S' || header[2] != 'Q') return false;
+
+        // Unknown flags are refused
+        if (header[3] < 1 || header[3] > TURBOSQUEEZE_FRAME_VERSION || header[4] < MIN_BLOCK_BITS || header[4] > MAX_BLOCK_BITS || (header[5] & ~(TURBOSQUEEZE_FRAME_LINKED | TURBOSQUEEZE_FRAME_DICTIONARY)) != 0)
+            blockBits = 0;
+        else
+        {
+            blockBits = header[4];
+            linked = (header[5] & TURBOSQUEEZE_FRAME_LINKED) != 0;
+            primed = (header[5] & TURBOSQUEEZE_FRAME_DICTIONARY) != 0;
+        }
+
+        return true;
+    }
+
+    // The dictionary id following the frame header must be the id of our dictionary
+    bool IDecompressor::checkDictionary( const uint8_t *id )
+    {
+        uint32_t frameId = id[0] | (id[1] << 8) | (id[2] << 16) | ((uint32_t) id[3] << 24);
+        return dictSize > 0 && frameId == dictId;
+    }
+
+    // Memory to memory: the blocks are decoded in place in dst
+    size_t IDecompressor::decompress( const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity )
+    {
+        if (src == nullptr || dst == nullptr) return 0;
+
+        size_t pos = 0;
+        size_t i = 0;
+
+        if (srcSize >= TURBOSQUEEZE_FRAME_HEADER_SZ && readFrameHeader( src ))
+        {
+            if (!blockBits) return 0;
+            i = TURBOSQUEEZE_FRAME_HEADER_SZ;
+
+            if (primed)
+            {
+                if (srcSize - i < TURBOSQUEEZE_DICT_ID_SZ || !checkDictionary( src+i )) return 0;
+                i += TURBOSQUEEZE_DICT_ID_SZ;
+            }
+        }
+
+        // Linked blocks are decoded here, where the previous block stays in front of the next one
+        if ((nThreads > 1 || (interleaved && streams() > 1)) && !linked && !primed)
+        {
+            MemoryReader reader;
+            MemoryWriter writer;
+
+            reader.set( (char*) src, srcSize );
+            writer.set( (char*) dst, dstCapacity );
+            decompress( &reader, &writer );
+
+            return writer.isOverflow() ? 0 : writer.getpos();
+        }
+
+        // With a dictionary, blocks are decoded after it in the window then copied to dst
+        uint32_t prefix = primed ? dictSize : 0;
+
+        if (primed && !loadWindow( &window, &windowBits, &windowLoaded, blockBits, dictionary, dictSize )) return 0;
+
+        while (i < srcSize)
+        {
+            if (srcSize - i < 6) return 0;
+
+            uint32_t to_read = src[i] | (src[i+1] << 8) | (src[i+2] << 16);
+            uint32_t size = src[i+3] | (src[i+4] << 8) | (src[i+5] << 16);
+            bool stored = (to_read & TURBOSQUEEZE_STORED) != 0;
+            bool escapes = (size & TURBOSQUEEZE_ESCAPES) != 0;
+            to_read &= ~TURBOSQUEEZE_STORED;
+            size &= ~TURBOSQUEEZE_ESCAPES;
+
+            // Corrupt data or too small destination?
+            if (to_read < 6 || to_read >= TURBOSQUEEZE_OUTPUT_SZ( blockBits ) || to_read > srcSize - i || size > TURBOSQUEEZE_BLOCK_SZ( blockBits ) || size > dstCapacity - pos || (stored && to_read-6 != size))
+                return 0;
+
+            uint32_t outputSize = size;
+            uint8_t *outbuff = primed ? window+TURBOSQUEEZE_LINK_SZ : dst+pos;
+
+            if (linked && !primed) prefix = pos < TURBOSQUEEZE_LINK_SZ ? pos : TURBOSQUEEZE_LINK_SZ;
+
+            if (stored)
+                memcpy( outbuff, src+i+6, size );
+            else if (escapes)
+                decodeEscapes( (uint8_t*) src+i+6, outbuff, &outputSize, to_read-6, prefix );
+            else
+                decode( (uint8_t*) src+i+6, outbuff, &outputSize, to_read-6 );
+
+            if (outputSize != size) return 0;
+
+            if (primed)
+            {
+                memcpy( dst+pos, outbuff, size );
+
+                if (linked)
+                {
+                    prefix = keepLink( window, prefix, size );
+                    windowLoaded = false;
+                }
+            }
+
+            i += to_read;
+            pos += size;
+        }
+
+        return pos;
+    }
+
+    void IDecompressor::decompress(IReader* reader, IWriter* writer)
+    {
+    	if (reader == nullptr || writer == nullptr) return;
+
+        // The first header is kept aside when it is already the header of the first block
+        uint8_t first[6];
+        uint8_t *inbuff;
+        size_t i;
+
+        if (reader->read((char**) &inbuff, &i, 6) != 6) return;
+
+        memcpy( first, inbuff+i, 6 );
+        bool framed = readFrameHeader( first );
+        if (!blockBits) return;
+
+        if (primed && (reader->read((char**) &inbuff, &i, TURBOSQUEEZE_DICT_ID_SZ) != TURBOSQUEEZE_DICT_ID_SZ || !checkDictionary( inbuff+i )))
+            return;
+
+        if ((nThreads > 1 || (interleaved && streams() > 1)) && !linked && !primed)
+        {
+            decompressParallel( reader, writer, framed ? nullptr : first );
+            return;
+        }
+
+        // Linked blocks are decoded after the end of the previous one or after the dictionary, then copied to the writer
+        const bool windowed = linked || primed;
+        uint32_t prefix = primed ? dictSize : 0;
+
+        if (windowed && !loadWindow( &window, &windowBits, &windowLoaded, blockBits, dictionary, dictSize )) return;
+
+        bool pending = !framed;
+
+    	do
+        {
+            if (pending)
+            {
+                inbuff = first;
+                i = 0;
+            }
+
+            if (pending || reader->read((char**) &inbuff, &i, 6) == 6)
+            {
+                pending = false;
+
+                uint32_t to_read = inbuff[i];
+                to_read += inbuff[i+1] << 8;
+                to_read += inbuff[i+2] << 16;
+
+                uint32_t size = inbuff[i+3];
+                size += inbuff[i+4] << 8;
+                size += inbuff[i+5] << 16;
+
+                bool stored = (to_read & TURBOSQUEEZE_STORED) != 0;
+                bool escapes = (size & TURBOSQUEEZE_ESCAPES) != 0;
+                to_read &= ~TURBOSQUEEZE_STORED;
+                size &= ~TURBOSQUEEZE_ESCAPES;
+
+                uint8_t *compressed;
+                size_t indice;
+
+                if (to_read >= 6 && to_read < TURBOSQUEEZE_OUTPUT_SZ( blockBits ) && size <= TURBOSQUEEZE_BLOCK_SZ( blockBits ) && (!stored || to_read-6 == size) && ((to_read-6) == reader->read((char**) &compressed, &indice, to_read-6)))
+                {
+                    uint8_t *out;
+                    uint32_t outputSize = size;
+
+                    writer->getdest( (char**) &out, size );
+
+                    if (windowed)
+                    {
+                        if (stored)
+                            memcpy( window+TURBOSQUEEZE_LINK_SZ, compressed+indice, size );
+                        else if (escapes)
+                            decodeEscapes( compressed+indice, window+TURBOSQUEEZE_LINK_SZ, &outputSize, to_read-6, prefix );
+                        else
+                            decode( compressed+indice, window+TURBOSQUEEZE_LINK_SZ, &outputSize, to_read-6 );
+
+                        if (out) memcpy( out, window+TURBOSQUEEZE_LINK_SZ, outputSize );
+
+                        if (linked)
+                        {
+                            prefix = keepLink( window, prefix, outputSize );
+                            windowLoaded = false;
+                        }
+                    }
+                    else if (stored)
+                    {
+                        if (out) memcpy( out, compressed+indice, size );
+                    }
+                    else if (escapes)
+                        decodeEscapes( compressed+indice, out, &outputSize, to_read-6 );
+                    else
+                        decode( compressed+indice, out, &outputSize, to_read-6 );
+
+                    writer->write( outputSize );
+                }
+            }
+        }
+        while ( !reader->eof() ) ;
+    }
+
+    void IDecompressor::decompressParallel(IReader* reader, IWriter* writer, const uint8_t *first)
+    {
+        // A job is a batch of nStreams blocks, laid out in the job arena when they need a copy
+        struct Job {
+            uint32_t count;
+            uint8_t *arena;
+            uint8_t *input[TURBOSQUEEZE_MAX_STREAMS];
+            uint8_t *output[TURBOSQUEEZE_MAX_STREAMS];
+            uint8_t *dest[TURBOSQUEEZE_MAX_STREAMS];
+            uint32_t inputStart[TURBOSQUEEZE_MAX_STREAMS];
+            uint32_t inputSize[TURBOSQUEEZE_MAX_STREAMS];
+            uint32_t outputStart[TURBOSQUEEZE_MAX_STREAMS];
+            uint32_t outputSize[TURBOSQUEEZE_MAX_STREAMS];
+            bool escapes[TURBOSQUEEZE_MAX_STREAMS];
+            bool stored[TURBOSQUEEZE_MAX_STREAMS];
+        };
+
+        const uint32_t nStreams = interleaved ? streams() : 1;
+        const bool persistentInput = reader->persistent() && nStreams == 1;
+        const bool persistentOutput = writer->persistent();
 
-                i += hitlength;
+        Job *jobs = new Job [nThreads];
 
-                if ((entryPos & 1) == 0)
-                    rep_last_i = i;
-            }
+        for (uint32_t k=0; k<nThreads; k++)
+        {
+            jobs[k].count = 0;
+            jobs[k].arena = (persistentInput && persistentOutput && nStreams == 1) ? nullptr : (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, nStreams*TURBOSQUEEZE_STREAM_SZ( blockBits ) );
 
-            // Write output/flush?
-            if (entryPos >= 8)
+            for (uint32_t n=0; n<nStreams; n++)
             {
-                j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, false, j );
+                jobs[k].inputStart[n] = n*TURBOSQUEEZE_STREAM_SZ( blockBits );
+                jobs[k].outputStart[n] = n*TURBOSQUEEZE_STREAM_SZ( blockBits ) + TURBOSQUEEZE_OUTPUT_SZ( blockBits );
             }
         }
 
-        // Remaining litterals at the end of the buffer?
-        if ((i-last_i) > 0)
         {
-            entryBuffer[entryPos].repeat = false;
-            entryBuffer[entryPos].size = i-last_i;
-            entryBuffer[entryPos].position = last_i;
-            entryBuffer[entryPos].base = rep_last_i;
-            entryPos++;
-        }
+            BlockPipeline pipeline( nThreads, [this, jobs, nStreams]( uint32_t k ) {
+                Job &job = jobs[k];
 
-        // Finalize stream
-        j += writeOutput( &entryBuffer[0], &entryPos, outptr+j, inputBlock, true, j );
+                // The multi-stream kernels only take 16 bit offsets and short tokens
+                bool batch = job.count == nStreams && nStreams > 1;
+                for (uint32_t n=0; n<job.count; n++)
+                    if (job.escapes[n] || job.stored[n]) batch = false;
 
-        *outputSize += j;
-    }
+                if (batch)
+                {
+                    decodeStreams( job.arena, job.inputStart, job.inputSize, job.outputStart, job.outputSize );
+                }
+                else
+                {
+                    for (uint32_t n=0; n<job.count; n++)
+                    {
+                        if (job.stored[n])
+                            memcpy( job.output[n], job.input[n], job.outputSize[n] );
+                        else if (job.escapes[n])
+                            decodeEscapes( job.input[n], job.output[n], &job.outputSize[n], job.inputSize[n] );
+                        else
+                            decode( job.input[n], job.output[n], &job.outputSize[n], job.inputSize[n] );
+                    }
+                }
 
-    static inline uint32_t getHash( uint32_t h )
-    {
-        return (((h & (0xFFFFFFFF - (TURBOSQUEEZE_REFHASH_SZ - 1))) >> (32-TURBOSQUEEZE_REFHASH_BITS)) ^ (h & (TURBOSQUEEZE_REFHASH_SZ - 1)));
-    }
+                for (uint32_t n=0; n<job.count; n++)
+                    if (job.dest[n] != job.output[n]) memcpy( job.dest[n], job.output[n], job.outputSize[n] );
+            } );
 
-    static inline uint32_t getHash2( uint32_t h )
-    {
-        return (((h & (0xFFFFFFFF - (TURBOSQUEEZE_REFHASH_PLUS_SZ - 1))) >> (32-TURBOSQUEEZE_BLOCK_BITS)) ^ (h & (TURBOSQUEEZE_REFHASH_PLUS_SZ - 1)));
-    }
+            bool overflow = false;
 
-    static inline uint32_t matchlen( uint8_t *inbuff, uint32_t first, uint32_t second, uint32_t decoded_size, uint32_t size )
-    {
-        uint32_t maxmatchstrlen = 16;
+            // Blocks decoded into the writer memory were already written, the others are copied in order
+            auto flush = [&]( uint32_t k ) {
+                if (pipeline.wait( k ) && !persistentOutput)
+                {
+                    for (uint32_t n=0; n<jobs[k].count && !overflow; n++)
+                    {
+                        uint8_t *out;
+                        writer->getdest( (char**) &out, jobs[k].outputSize[n] );
 
-        maxmatchstrlen = (first+maxmatchstrlen < decoded_size) ? maxmatchstrlen : decoded_size-first;
-        maxmatchstrlen = (second+maxmatchstrlen) < size ? maxmatchstrlen : size - second;
-        maxmatchstrlen = (second-first) < maxmatchstrlen ? second-first : maxmatchstrlen;
+                        if (out)
+                        {
+                            memcpy( out, jobs[k].output[n], jobs[k].outputSize[n] );
+                            writer->write( jobs[k].outputSize[n] );
+                        }
+                        else
+                            overflow = true;
+                    }
+                }
 
-        if (maxmatchstrlen >= 4)
-        {
-            uint32_t i = 4;
-            uint8_t *strfirst = inbuff+first;
-            uint8_t *strsecond = inbuff+second;
+                jobs[k].count = 0;
+            };
 
-            while ((i < maxmatchstrlen) && (strfirst[i] == strsecond[i])) i++;
+            uint32_t block = 0;
+            uint32_t k = 0;
 
-            return i;
-        }
-        else
-            return 0;
-    }
+            do
+            {
+                uint8_t *inbuff = (uint8_t*) first;
+                size_t i = 0;
 
-    FastCompressor::FastCompressor( uint32_t compression_level ) : ICompressor( compression_level )
-    {
-        refhashcount = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_REFHASH_SZ*sizeof(uint8_t) );
-        refhash = (FastCompressor::SymRefFast*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_REFHASH_SZ*TURBOSQUEEZE_REFHASH_ENTITIES*sizeof(FastCompressor::SymRefFast) );
-    }
+                Job &job = jobs[k];
 
-    FastCompressor::~FastCompressor()
-    {
-        if (refhash != nullptr) align_free(refhash);
-        if (refhashcount != nullptr) align_free(refhashcount);
-    }
+                if (first || reader->read((char**) &inbuff, &i, 6) == 6)
+                {
+                    first = nullptr;
 
-    void FastCompressor::init()
-    {
-        memset( refhashcount, 0, TURBOSQUEEZE_REFHASH_SZ*sizeof(uint8_t) );
-    }
+                    uint32_t to_read = inbuff[i];
+                    to_read += inbuff[i+1] << 8;
+                    to_read += inbuff[i+2] << 16;
 
-    bool FastCompressor::addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos)
-    {
-        if (i < size-3)
-        {
-            uint32_t str4 = *((uint32_t*) (input+i));
-            uint32_t hash = getHash(str4);
-            uint32_t hitidx = hash*TURBOSQUEEZE_REFHASH_ENTITIES;
-            uint32_t j = 0;
+                    uint32_t size = inbuff[i+3];
+                    size += inbuff[i+4] << 8;
+                    size += inbuff[i+5] << 16;
 
-            while (j < refhashcount[hash] && refhash[hitidx].sym4 != str4)
-            {
-                j++;
-                hitidx++;
-            }
+                    bool stored = (to_read & TURBOSQUEEZE_STORED) != 0;
+                    bool escapes = (size & TURBOSQUEEZE_ESCAPES) != 0;
+                    to_read &= ~TURBOSQUEEZE_STORED;
+                    size &= ~TURBOSQUEEZE_ESCAPES;
 
-            if (j < refhashcount[hash])
-            {
-                // Hit sym
-                uint32_t matchlength = matchlen( input, refhash[hitidx].latest_pos, i, decoded_size, size );
+                    uint8_t *compressed;
+                    size_t indice;
 
-                if (matchlength >= 4)
-                {
-                    hitlength = matchlength;
-                    hitpos = refhash[hitidx].latest_pos;
+                    if (to_read >= 6 && to_read < TURBOSQUEEZE_OUTPUT_SZ( blockBits ) && size <= TURBOSQUEEZE_BLOCK_SZ( blockBits ) && (!stored || to_read-6 == size) && ((to_read-6) == reader->read((char**) &compressed, &indice, to_read-6)))
+                    {
+                        uint32_t n = job.count;
 
-                    refhash[hitidx].latest_pos = i;
+                        if (persistentInput)
+                            job.input[n] = compressed+indice;
+                        else
+                        {
+                            job.input[n] = job.arena + job.inputStart[n];
+                            memcpy( job.input[n], compressed+indice, to_read-6 );
+                        }
 
-                    return true;
+                        job.output[n] = nStreams == 1 && persistentOutput ? nullptr : job.arena + job.outputStart[n];
+                        job.dest[n] = job.output[n];
+
+                        if (persistentOutput)
+                        {
+                            writer->getdest( (char**) &job.dest[n], size );
+
+                            if (job.dest[n])
+                                writer->write( size );
+                            else
+                                overflow = true;
+
+                            if (nStreams == 1) job.output[n] = job.dest[n];
+                        }
+
+                        if (!overflow)
+                        {
+                            job.inputSize[n] = to_read-6;
+                            job.outputSize[n] = size;
+                            job.escapes[n] = escapes;
+                            job.stored[n] = stored;
+                            job.count++;
+                        }
+                    }
                 }
-            }
-            else if (j < TURBOSQUEEZE_REFHASH_ENTITIES)
-            {
-                // New sym
-                refhash[hitidx].sym4 = str4;
-                refhash[hitidx].latest_pos = i;
 
-                refhashcount[hash]++;
+                // Submit full batches, or the last one
+                if (job.count > 0 && (job.count == nStreams || overflow || reader->eof()))
+                {
+                    pipeline.submit( k );
+
+                    block++;
+                    k = block % nThreads;
+                    flush( k );
+                }
             }
+            while ( !reader->eof() && !overflow ) ;
+
+            for (uint32_t n=0; n<nThreads; n++)
+                flush( (block+n) % nThreads );
         }
 
-        return false;
-    }
+        for (uint32_t k=0; k<nThreads; k++)
+            if (jobs[k].arena) align_free( jobs[k].arena );
 
-    FastNCompressor::FastNCompressor( uint32_t c_level ) : ICompressor( c_level<11? 1<<c_level:1<<10 )
-    {
-        refhashcount = (uint8_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_REFHASH_PLUS_SZ*sizeof(uint8_t) );
-        hash = (FastNCompressor::SymRef*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_REFHASH_PLUS_SZ*TURBOSQUEEZE_REFHASH_ENTITIES*sizeof(FastNCompressor::SymRef) );
-        positions = (uint32_t*) align_alloc( MAX_CACHE_LINE_SIZE, TURBOSQUEEZE_MAX_SYMS*compressionLevel*sizeof(uint32_t) );
-        posIdx = 0;
+        delete [] jobs;
     }
 
-    FastNCompressor::~FastNCompressor()
+    static uint16_t read16BE( const uint8_t* stream )
     {
-        if (refhashcount != nullptr) align_free(refhashcount);
-        if (hash != nullptr) align_free(hash);
-        if (positions != nullptr) align_free(positions);
+        return stream[0] | (stream[1] << 8);
     }
 
-    void FastNCompressor::init()
+    // Exact decoding of the end of a block, outbuff is the current output position inside the block
+    void IDecompressor::decodeFinalSafeInternal( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
     {
-        memset( refhashcount, 0, TURBOSQUEEZE_REFHASH_PLUS_SZ*sizeof(uint8_t) );
-        posIdx = 0;
-    }
+        uint32_t size = *outputSize;
+        uint32_t i=0, j=0;
 
-    bool FastNCompressor::addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos)
-    {
-        if (i < size-3)
+        while (j < size && i < inputSize)
         {
-            uint32_t str4 = *((uint32_t*) (input+i));
-            uint32_t hsh = getHash2(str4);
-            uint32_t hitidx = hsh*TURBOSQUEEZE_REFHASH_ENTITIES;
-            uint32_t j = 0;
+            uint8_t ctrl_byte = inputBlock[i++];
+            uint32_t ctrl_mask = 1 << 7;
 
-            while (j < refhashcount[hsh] && hash[hitidx].sym4 != str4)
+            while (j < size && ctrl_mask)
             {
-                j++;
-                hitidx++;
-            }
+                uint32_t base = j;
 
-            if (j < refhashcount[hsh])
-            {
-                if (hash[hitidx].n_occurences == 1)
-                {
-                    uint32_t matchlength = matchlen( input, hash[hitidx].position, i, decoded_size, size );
+                if (i >= inputSize) break;
+                uint8_t ctr = inputBlock[i++];
 
-                    if (matchlength >= 4)
-                    {
-                        hash[hitidx].n_occurences++;
+                uint32_t sz1 = (ctr >> 4) + 1;
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
 
-                        hitlength = matchlength;
-                        hitpos = hash[hitidx].position;
+                // Corrupt data?
+                if ((rep1 ? 2 : sz1) > inputSize-i) { *outputSize = j; return; }
+                uint8_t *src1 = rep1 ? outputBlock + base - read16BE( &inputBlock[i] ) : &inputBlock[i];
 
-                        // allocate hits
-                        uint32_t firstpos = hash[hitidx].position;
-                        uint32_t pos = hash[hitidx].position = posIdx;
+                if (sz1 > size-j) sz1 = size-j;
+                memcpy( outputBlock+j, src1, sz1 );
 
-                        positions[pos] = firstpos;
-                        positions[pos+1] = i;
+                i += rep1 ? 2 : sz1;
+                j += sz1;
 
-                        posIdx += compressionLevel;
+                if (j >= size) break;
 
-                        return true;
-                    }
-                }
-                else
-                {
-                    uint32_t n_occ = hash[hitidx].n_occurences > compressionLevel ? compressionLevel : hash[hitidx].n_occurences;
-                    uint32_t pos = hash[hitidx].position;
-                    uint32_t maxmatchlength = 0;
-                    uint32_t maxmatchpos = 0xFFFFFFFF;
+                ctrl_mask >>= 1;
 
-                    for (uint32_t k=0; k<n_occ; k++)
-                    {
-                        if ((decoded_size - positions[pos+k]) < ((1<<16) - 32))
-                        {
-                            uint32_t matchlength = matchlen( input, positions[pos+k], i, decoded_size, size );
-
-                            if (matchlength > maxmatchlength)
-                            {
-                                maxmatchlength = matchlength;
-                                maxmatchpos = positions[pos+k];
-
-                                if (maxmatchlength == 16) break;
-                            }
-                            else if (matchlength == maxmatchlength && positions[pos+k] > maxmatchpos)
-                            {
-                                maxmatchpos = positions[pos+k];
-                            }
-                        }
-                    }
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+                uint32_t sz2 = (ctr & 0xF) + 1;
 
-                    if (maxmatchlength >= 4)
-                    {
-                        positions[pos+(hash[hitidx].n_occurences%compressionLevel)] = i;
-                        hash[hitidx].n_occurences++;
+                if ((rep2 ? 2 : sz2) > inputSize-i) { *outputSize = j; return; }
+                uint8_t *src2 = rep2 ? outputBlock + base - read16BE( &inputBlock[i] ) : &inputBlock[i];
 
-                        hitlength = maxmatchlength;
-                        hitpos = maxmatchpos;
+                if (sz2 > size-j) sz2 = size-j;
+                memcpy( outputBlock+j, src2, sz2 );
 
-                        return true;
-                    }
-                }
-            }
-            else if (j < TURBOSQUEEZE_REFHASH_ENTITIES)
-            {
-                // New sym
-                hash[hitidx].sym4 = str4;
-                hash[hitidx].position = i;
-                hash[hitidx].n_occurences = 1;
+                i += rep2 ? 2 : sz2;
+                j += sz2;
 
-                refhashcount[hsh]++;
+                ctrl_mask >>= 1;
             }
         }
 
-        return false;
+        *outputSize = j;
     }
 
-    // Decompressor
-    static bool isLittleEndian()
+    static inline bool readLength( const uint8_t *stream, uint32_t *i, uint32_t inputSize, uint32_t *length )
     {
-    #if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-        return true;
-    #elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-        return false;
-    #elif defined(__clang__) && __LITTLE_ENDIAN__
-        return true;
-    #elif defined(__clang__) && __BIG_ENDIAN__
-        return false;
-    #elif defined(_MSC_VER) && (_M_AMD64 || _M_IX86)
-        return true;
-    #elif defined(__DMC__) && defined(_M_IX86)
-        return true;
-    #else
-        static union { uint32_t u; uint8_t c[4]; } one = { 1 };
-        return one.c[0] != 0;
-    #endif
-    }
+        uint32_t value = 0;
 
-    class LittleEndianDecompressor : public IDecompressor {
-    public:
-        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
-    };
+        for (uint32_t shift = 0; shift < 28; shift += 7)
+        {
+            if (*i >= inputSize) return false;
 
-    class BigEndianDecompressor : public IDecompressor {
-    public:
-        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
-    };
+            uint8_t byte = stream[(*i)++];
+            value |= (byte & 0x7F) << shift;
 
-    class AVX2Decompressor : public IDecompressor {
-    public:
-        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
-    };
+            if ((byte & 0x80) == 0)
+            {
+                *length = value + 17;
+                return true;
+            }
+        }
+
+        return false;
+    }
 
-    IDecompressor* DecompressorFactory()
+    // Long repeats are copied 16 bytes at a time when their source is far enough behind, the copy then reads what it just wrote
+    static inline void copyRepeat( uint8_t *dst, uint8_t *src, uint32_t length, bool slack )
     {
-        if (!isLittleEndian())
-            return new BigEndianDecompressor();
+        uint32_t k = 0;
+
+        if (dst - src >= 16)
+        {
+            for (; k + 16 <= length; k += 16)
+                turbosqueeze_memcpy16( dst+k, src+k );
+
+            if (k < length && slack)
+            {
+                turbosqueeze_memcpy16( dst+k, src+k );
+                return;
+            }
+        }
 
-        #ifdef AVX2
-        return new AVX2Decompressor();
-		#else
-        return new LittleEndianDecompressor();
-		#endif
+        for (; k < length; k++)
+            dst[k] = src[k];
     }
 
-    void DecompressorDestroy( IDecompressor* decompressor )
+    // One token of a block with escapes near the ends of the block or with an escape, checked against the ends of the block
+    static inline bool decodeToken( uint8_t *inputBlock, uint32_t *i, uint32_t inputSize, uint8_t *outputBlock, uint32_t *j, uint32_t size, uint32_t base, uint32_t prefix, uint32_t length, bool rep )
     {
-        delete decompressor;
+        uint32_t offset = 0;
+
+        if (rep)
+        {
+            if (*i + 2 > inputSize) return false;
+
+            offset = read16BE( &inputBlock[*i] );
+            *i += 2;
+
+            if (offset == 0)
+            {
+                if (*i + 3 > inputSize) return false;
+
+                uint32_t field = inputBlock[*i] | (inputBlock[*i+1] << 8) | (inputBlock[*i+2] << 16);
+                *i += 3;
+
+                offset = field & TURBOSQUEEZE_OFFSET_MASK;
+
+                if ((field & TURBOSQUEEZE_LONG_TOKEN) && !readLength( inputBlock, i, inputSize, &length )) return false;
+
+                rep = (field & TURBOSQUEEZE_LONG_LITERALS) == 0;
+            }
+
+            if (rep && offset > base + prefix) return false;
+        }
+
+        if (length > size - *j) return false;
+
+        uint8_t *dst = &outputBlock[*j];
+        bool slack = *j + length + 16 <= size;
+
+        if (rep)
+        {
+            uint8_t *src = outputBlock + base - offset;
+
+            if (length <= 16 && slack)
+                turbosqueeze_memcpy16( dst, src );
+            else
+                copyRepeat( dst, src, length, slack );
+        }
+        else
+        {
+            if (length > inputSize - *i) return false;
+
+            if (length <= 16 && slack && *i + 16 <= inputSize)
+                turbosqueeze_memcpy16( dst, &inputBlock[*i] );
+            else
+                memcpy( dst, &inputBlock[*i], length );
+
+            *i += length;
+        }
+
+        *j += length;
+        return true;
     }
 
-    void IDecompressor::decompress(IReader* reader, IWriter* writer)
+    // Blocks with escapes, byte order independent. Offsets before the start of the block and its prefix stop the decoding.
+    void IDecompressor::decodeEscapes( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize, uint32_t prefix )
     {
-    	if (reader == nullptr || writer == nullptr) return;
+        uint32_t size = *outputSize;
 
-    	do
+        *outputSize = 0;
+
+        // Corrupt data?
+        if (size > TURBOSQUEEZE_BLOCK_SZ( MAX_BLOCK_BITS )) return;
+
+        uint32_t i=0, j=0;
+
+        while (j < size && i < inputSize)
         {
-            uint8_t *inbuff;
-            size_t i;
+            uint8_t ctrl_byte = inputBlock[i++];
+            uint32_t ctrl_mask = 1 << 7;
+
+            // A group of short tokens reads and writes less than the tail size
+            bool wild = j + TURBOSQUEEZE_TAIL_SZ < size && i + TURBOSQUEEZE_TAIL_SZ < inputSize;
 
-            if (reader->read((char**) &inbuff, &i, 6) == 6)
+            while (ctrl_mask && (wild || (j < size && i < inputSize)))
             {
-                uint32_t to_read = inbuff[i];
-                to_read += inbuff[i+1] << 8;
-                to_read += inbuff[i+2] << 16;
+                uint32_t base = j;
 
-                uint32_t size = inbuff[i+3];
-                size += inbuff[i+4] << 8;
-                size += inbuff[i+5] << 16;
+                uint8_t ctr = inputBlock[i++];
 
-                uint8_t *compressed;
-                size_t indice;
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+                uint32_t offset1 = wild ? read16BE( &inputBlock[i] ) : 0;
 
-                if (to_read > 0 && to_read < TURBOSQUEEZE_OUTPUT_SZ && ((to_read-6) == reader->read((char**) &compressed, &indice, to_read-6)))
+                // One test for the rare escapes, the repeat bit itself takes no branch
+                if (wild & !(rep1 & (offset1 - 1 >= base + prefix)))
                 {
-                    uint8_t *out;
-                    uint32_t outputSize = size;
+                    uint32_t sz1 = (ctr >> 4) + 1;
 
-                    writer->getdest( (char**) &out, size );
-                    decode( compressed+indice, out, &outputSize, to_read );
-                    writer->write( outputSize );
+                    turbosqueeze_memcpy16( &outputBlock[j], rep1 ? outputBlock + base - offset1 : &inputBlock[i] );
+
+                    i += rep1 ? 2 : sz1;
+                    j += sz1;
+                }
+                else
+                {
+                    // Copies of the positions so they stay in registers on the common path
+                    uint32_t in = i, out = j;
+                    if (!decodeToken( inputBlock, &in, inputSize, outputBlock, &out, size, base, prefix, (ctr >> 4) + 1, rep1 )) return;
+                    i = in;
+                    j = out;
+                    wild = wild && j + TURBOSQUEEZE_TAIL_SZ < size && i + TURBOSQUEEZE_TAIL_SZ < inputSize;
+                }
+
+                ctrl_mask >>= 1;
+
+                if (!wild && j >= size) break;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+                uint32_t offset2 = wild ? read16BE( &inputBlock[i] ) : 0;
+
+                // One test for the rare escapes, the repeat bit itself takes no branch
+                if (wild & !(rep2 & (offset2 - 1 >= base + prefix)))
+                {
+                    uint32_t sz2 = (ctr & 0xF) + 1;
+
+                    turbosqueeze_memcpy16( &outputBlock[j], rep2 ? outputBlock + base - offset2 : &inputBlock[i] );
+
+                    i += rep2 ? 2 : sz2;
+                    j += sz2;
                 }
+                else
+                {
+                    // Copies of the positions so they stay in registers on the common path
+                    uint32_t in = i, out = j;
+                    if (!decodeToken( inputBlock, &in, inputSize, outputBlock, &out, size, base, prefix, (ctr & 0xF) + 1, rep2 )) return;
+                    i = in;
+                    j = out;
+                    wild = wild && j + TURBOSQUEEZE_TAIL_SZ < size && i + TURBOSQUEEZE_TAIL_SZ < inputSize;
+                }
+
+                ctrl_mask >>= 1;
             }
         }
-        while ( !reader->eof() ) ;
+
+        *outputSize = j;
     }
 
     // Decompressor
@@ -758,11 +2902,11 @@ namespace TurboSqueeze {
         *outputSize = 0;
 
         // Corrupt data?
-        if (size > TURBOSQUEEZE_BLOCK_SZ) return;
+        if (size > TURBOSQUEEZE_BLOCK_SZ( MAX_BLOCK_BITS )) return;
 
         uint32_t i=0, j=0;
 
-        while (j < size)
+        while (j + TURBOSQUEEZE_TAIL_SZ < size)
         {
             uint8_t ctrl_byte = inputBlock[i]; i++;
             uint32_t ctrl_mask = 1 << 7;
@@ -779,7 +2923,7 @@ namespace TurboSqueeze {
 
                 bool rep1 = (ctrl_byte & ctrl_mask) != 0;
 
-                uint8_t *src1 = rep1 ? &outputBlock[base-offset1] : &inputBlock[i];
+                uint8_t *src1 = rep1 ? outputBlock + base - offset1 : &inputBlock[i];
 
                 turbosqueeze_memcpy16( &outputBlock[j], src1 );
 
@@ -793,7 +2937,7 @@ namespace TurboSqueeze {
                 uint32_t sz2 = (ctr & 0xF) + 1;
                 uint32_t offset2 = *((uint16_t*) (&inputBlock[i]));
 
-                uint8_t *src2 = rep2 ? &outputBlock[base-offset2] : &inputBlock[i];
+                uint8_t *src2 = rep2 ? outputBlock + base - offset2 : &inputBlock[i];
 
                 turbosqueeze_memcpy16( &outputBlock[j], src2 );
 
@@ -804,12 +2948,11 @@ namespace TurboSqueeze {
             }
         }
 
-        *outputSize = size;
-    }
+        // Last bytes of the block
+        uint32_t tail = size - j;
+        decodeFinalSafeInternal( inputBlock+i, outputBlock+j, &tail, i < inputSize ? inputSize-i : 0 );
 
-    static uint16_t read16BE( const uint8_t* stream )
-    {
-        return stream[0] | (stream[1] << 8);
+        *outputSize = j + tail;
     }
 
     void BigEndianDecompressor::decode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
@@ -819,11 +2962,11 @@ namespace TurboSqueeze {
         *outputSize = 0;
 
         // Corrupt data?
-        if (size > TURBOSQUEEZE_BLOCK_SZ) return;
+        if (size > TURBOSQUEEZE_BLOCK_SZ( MAX_BLOCK_BITS )) return;
 
         uint32_t i=0, j=0;
 
-        while (j < size)
+        while (j + TURBOSQUEEZE_TAIL_SZ < size)
         {
             uint8_t ctrl_byte = inputBlock[i]; i++;
             uint32_t ctrl_mask = 1 << 7;
@@ -839,7 +2982,7 @@ namespace TurboSqueeze {
 
                 bool rep1 = (ctrl_byte & ctrl_mask) != 0;
 
-                uint8_t *src1 = rep1 ? &outputBlock[base-offset1] : &inputBlock[i];
+                uint8_t *src1 = rep1 ? outputBlock + base - offset1 : &inputBlock[i];
 
                 turbosqueeze_memcpy16( &outputBlock[j], src1 );
 
@@ -853,7 +2996,7 @@ namespace TurboSqueeze {
                 uint32_t sz2 = (ctr & 0xF) + 1;
                 uint32_t offset2 = read16BE( &inputBlock[i] );
 
-                uint8_t *src2 = rep2 ? &outputBlock[base-offset2] : &inputBlock[i];
+                uint8_t *src2 = rep2 ? outputBlock + base - offset2 : &inputBlock[i];
 
                 turbosqueeze_memcpy16( &outputBlock[j], src2 );
 
@@ -864,7 +3007,11 @@ namespace TurboSqueeze {
             }
         }
 
-        *outputSize = size;
+        // Last bytes of the block
+        uint32_t tail = size - j;
+        decodeFinalSafeInternal( inputBlock+i, outputBlock+j, &tail, i < inputSize ? inputSize-i : 0 );
+
+        *outputSize = j + tail;
     }
 
 }
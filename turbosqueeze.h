@@ -37,10 +37,29 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 
 
 namespace TurboSqueeze {
 
+    // Blocks hold 1<<block_bits bytes, from 64 KB to 4 MB. The block size is recorded in the frame header.
+    const uint32_t MIN_BLOCK_BITS = 16;
+    const uint32_t MAX_BLOCK_BITS = 22;
+    const uint32_t DEFAULT_BLOCK_BITS = 18;
+
+    // Dictionaries are primed in front of the blocks, only their last 64 KB are used
+    const uint32_t MAX_DICTIONARY_SIZE = 1<<16;
+
+    // Above the greedy and lazy levels 1..10, the ultra level parses every block for the fewest output bytes.
+    // Its parse takes 24 bytes per position of the block and linked prefix, about 100 MB per compressor at 22 bits.
+    const uint32_t ULTRA_LEVEL = 11;
+
+    // Level 0 skips ahead in data without matches, see ICompressor::setAcceleration()
+    const uint32_t DEFAULT_ACCELERATION = 1;
+
     /*
      * Reader interface
      */
@@ -50,6 +69,8 @@ namespace TurboSqueeze {
         virtual size_t read(char** buffer, size_t *bufferStart, size_t bufferSize) = 0;
         virtual size_t getpos() = 0;
         virtual bool eof() = 0;
+        // True when the buffers returned by read() stay valid until the reader is destroyed
+        virtual bool persistent() { return false; }
     };
 
     void ReaderDestroy( IReader* reader );
@@ -63,6 +84,8 @@ namespace TurboSqueeze {
         virtual void getdest(char** data, size_t size) = 0;
         virtual size_t getpos() = 0;
         virtual void write(size_t dataSize) = 0;
+        // True when the memory returned by getdest() stays valid after write(), so it may be filled later
+        virtual bool persistent() { return false; }
     };
 
     void WriterDestroy( IWriter* writer );
@@ -84,6 +107,27 @@ namespace TurboSqueeze {
 
     FileReader* FileReaderFactory( const char* filename );
 
+    // Memory mapped File Reader declaration, read() returns pointers into the mapping without copying
+    class MappedFileReader : public IReader {
+        const char *filename;
+        char* memoryData;
+        size_t memorySize;
+        size_t currentPosition;
+        size_t advised;
+        bool opened;
+        void open();
+    public:
+        MappedFileReader() : filename(nullptr), memoryData(nullptr), memorySize(0), currentPosition(0), advised(0), opened(false) {}
+        ~MappedFileReader();
+        bool eof() override { return (memoryData == nullptr) || currentPosition >= memorySize; }
+        bool persistent() override { return true; }
+        void set(const char* file) { filename = file; }
+        size_t getpos() override { return currentPosition; }
+        size_t read(char** buffer, size_t *bufferStart, size_t bufferSize) override;
+    };
+
+    MappedFileReader* MappedFileReaderFactory( const char* filename );
+
     // Memory Reader declaration
     class MemoryReader : public IReader {
         char* memoryData;
@@ -93,6 +137,7 @@ namespace TurboSqueeze {
         MemoryReader() : memoryData(nullptr), memorySize(0), currentPosition(0) {}
         ~MemoryReader();
         bool eof() override { return currentPosition >= memorySize; }
+        bool persistent() override { return true; }
         void set(char* data, size_t size) { memoryData = data; memorySize = size; }
         size_t getpos() override { return currentPosition; }
         size_t read(char** buffer, size_t *bufferStart, size_t bufferSize) override;
@@ -100,18 +145,33 @@ namespace TurboSqueeze {
 
     MemoryReader* MemoryReaderFactory( char* buffer, size_t size );
 
-    // File Writer declaration
+    // File Writer declaration, written buffers are flushed by a background thread while the next ones are filled
     class FileWriter : public IWriter {
+        static const uint32_t nBuffers = 3;
         const char *filename;
         FILE *outfile;
-        uint8_t *buffer;
+        uint8_t *buffers[nBuffers];
+        size_t sizes[nBuffers];
+        uint32_t first;
+        uint32_t pending;
+        size_t position;
+        bool stop;
+        bool failed;
+        std::thread *flusher;
+        std::mutex lock;
+        std::condition_variable changed;
+        void flush();
     public:
-        FileWriter() : filename(nullptr), outfile(nullptr), buffer(nullptr) {}
+        FileWriter() : filename(nullptr), outfile(nullptr), buffers(), sizes(), first(0), pending(0), position(0), stop(false), failed(false), flusher(nullptr) {}
         ~FileWriter();
         void set(const char* file) { filename = file; }
         void getdest(char** data, size_t size) override;
-        size_t getpos() override { if (outfile) { return ftell(outfile); } else return 0; }
+        size_t getpos() override { return position; }
         void write(size_t dataSize) override;
+        // Flushes the buffers in flight and closes the file, the destructor calls it too
+        void close();
+        // True when the file could not be opened or a write failed, checked after close()
+        bool isFailed() const { return failed; }
     };
 
     FileWriter* FileWriterFactory( const char* file );
@@ -129,44 +189,219 @@ namespace TurboSqueeze {
         void getdest(char** data, size_t size) override;
         void write(size_t dataSize) override;
         size_t getpos() override { return currentPosition; }
+        bool persistent() override { return true; }
         bool isOverflow() const { return overflow; }
     };
 
     MemoryWriter* MemoryWriterFactory( char* data, size_t size );
 
+#if defined(__linux__)
+    struct UringReaderContext;
+    struct UringWriterContext;
+
+    // io_uring File Reader declaration, chunked reads are kept in flight ahead of the consumer
+    class UringFileReader : public IReader {
+        const char *filename;
+        bool direct;
+        UringReaderContext *ctx;
+        size_t position;
+        uint64_t fileSize;
+        bool failed;
+        void open();
+    public:
+        UringFileReader() : filename(nullptr), direct(false), ctx(nullptr), position(0), fileSize(0), failed(false) {}
+        ~UringFileReader();
+        bool eof() override { return (ctx == nullptr) || failed || position >= fileSize; }
+        void set(const char* file, bool o_direct) { filename = file; direct = o_direct; }
+        size_t getpos() override { return position; }
+        size_t read(char** buffer, size_t *bufferStart, size_t bufferSize) override;
+        // True when a read failed or the file got shorter, the data read stops there
+        bool isFailed() const { return failed; }
+    };
+
+    UringFileReader* UringFileReaderFactory( const char* filename, bool o_direct = false );
+
+    // io_uring File Writer declaration, blocks are gathered in chunks written behind the producer
+    class UringFileWriter : public IWriter {
+        const char *filename;
+        bool direct;
+        UringWriterContext *ctx;
+        size_t position;
+        bool failed;
+        void open();
+    public:
+        UringFileWriter() : filename(nullptr), direct(false), ctx(nullptr), position(0), failed(false) {}
+        ~UringFileWriter();
+        void set(const char* file, bool o_direct) { filename = file; direct = o_direct; }
+        void getdest(char** data, size_t size) override;
+        size_t getpos() override { return position; }
+        void write(size_t dataSize) override;
+        // Writes the last chunk and waits for the writes in flight, the destructor calls it too
+        void close();
+        // True when a write failed, checked after close()
+        bool isFailed() const { return failed; }
+    };
+
+    UringFileWriter* UringFileWriterFactory( const char* filename, bool o_direct = false );
+#endif
+
+    struct ParseNode;
+
     /*
      * Compressor interface
      */
     class ICompressor {
     protected:
         uint32_t compressionLevel;
-        void encode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize );
-        virtual bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos) = 0;
-        virtual void init() = 0;
+        uint32_t blockBits;
+        ICompressor **workers;
+        uint32_t nWorkers;
+        uint8_t *scratch;
+        bool linked;
+        uint8_t *dictionary;
+        uint32_t dictSize;
+        uint32_t dictId;
+        uint32_t *dictIndex;
+        uint32_t dictIndexBits;
+        uint32_t acceleration;
+        uint8_t *window;
+        uint32_t windowBits;
+        bool windowLoaded;
+        ParseNode *parseNodes;
+        uint32_t parseSize;
+        // The dictionary is searched through its own table, built once, instead of being added to the tables of every block
+        void indexDictionary();
+        bool dictHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, uint32_t &hitlength, uint32_t &hitpos );
+        // Usable match at i, from the tables or the dictionary, extended past 16 bytes
+        bool findHit( uint8_t *input, uint32_t i, uint32_t base, uint32_t size, bool indexed, uint32_t &hitlength, uint32_t &hitpos );
+        // Cheapest tokens for the block, with the sizes they take in the output
+        void parseOptimal( uint8_t *input, uint32_t prefix, uint32_t size, bool indexed );
+        // dictPrefix tells that the prefix is the dictionary alone, not the end of a previous linked block
+        void encode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize, uint32_t prefix = 0, bool dictPrefix = false );
+        uint32_t encodeBlock( uint8_t *inbuff, uint8_t *outbuff, uint32_t inputSize, uint32_t prefix = 0, bool dictPrefix = false );
+        bool writeFrameHeader( IWriter* writer );
+        void compressParallel(IReader* reader, IWriter* writer);
+        // Adds position i to the tables and returns its best match, extend compares the candidates past 16 bytes
+        virtual bool addHit( uint8_t *input, uint32_t i, uint32_t decoded_size, uint32_t size, bool extend, uint32_t &hitlength, uint32_t &hitpos) = 0;
+        // Prepares the match finder for a block of inputSize bytes
+        virtual void init( uint32_t inputSize ) = 0;
+        virtual ICompressor* createWorker() = 0;
     public:
-        ICompressor( uint32_t compression_level ) : compressionLevel( compression_level ) {}
-        virtual ~ICompressor() {}
+        ICompressor( uint32_t compression_level ) : compressionLevel( compression_level ), blockBits( DEFAULT_BLOCK_BITS ), workers( nullptr ), nWorkers( 0 ), scratch( nullptr ), linked( false ), dictionary( nullptr ), dictSize( 0 ), dictId( 0 ), dictIndex( nullptr ), dictIndexBits( 0 ), acceleration( 0 ), window( nullptr ), windowBits( 0 ), windowLoaded( false ), parseNodes( nullptr ), parseSize( 0 ) {}
+        virtual ~ICompressor();
+        // Blocks are encoded concurrently by n_threads contexts and written in order
+        void setThreads( uint32_t n_threads );
+        // Larger blocks mean fewer headers, smaller ones more parallelism and lower latency
+        void setBlockBits( uint32_t block_bits );
+        uint32_t getBlockBits() const { return blockBits; }
+        // Linked blocks reference the end of the previous block, which helps small repeated records.
+        // They are decoded one after the other, independent blocks stay the default.
+        void setLinkedBlocks( bool linked_blocks ) { linked = linked_blocks; }
+        bool getLinkedBlocks() const { return linked; }
+        // Every block may reference the dictionary, which helps small records sharing a schema.
+        // The decoder needs the same dictionary, nullptr removes it.
+        void setDictionary( const uint8_t* dict, size_t size );
+        // Match candidates compared per position from level 1, more find longer matches. 0 restores the one of the level.
+        void setSearchDepth( uint32_t depth );
+        // After 64 positions without a match the scan steps 2 bytes, then 3 after 64 more, and so on. Larger values
+        // start with larger steps, for speed on incompressible data at some ratio. 0 searches every position, the
+        // default of the levels above 0.
+        void setAcceleration( uint32_t accel );
         void compress(IReader* reader, IWriter* writer);
+        // Memory to memory, returns the compressed size or 0 when dst is too small
+        size_t compress( const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity );
+        // Forgets the previous input in O(1), the tables are kept
+        void reset() { init( 0 ); }
+        virtual uint32_t getLevel() const = 0;
     };
 
-    ICompressor* CompressorFactory( uint32_t compression_level );
+    ICompressor* CompressorFactory( uint32_t compression_level, uint32_t n_threads = 1, uint32_t block_bits = DEFAULT_BLOCK_BITS, bool linked_blocks = false );
     void CompressorDestroy( ICompressor* compressor );
 
+    /*
+     * Compressor pool: contexts are handed out again instead of reallocating and faulting in their tables.
+     * One pool may be shared by a thread pool, or kept per thread.
+     */
+    class CompressorPool {
+        static const uint32_t nLevels = ULTRA_LEVEL + 1;
+        std::mutex lock;
+        std::vector<ICompressor*> available[nLevels];
+    public:
+        CompressorPool() {}
+        ~CompressorPool();
+        // A free context for compression_level, created when there is none
+        ICompressor* acquire( uint32_t compression_level );
+        // Gives back a context taken with acquire(), restored to the factory defaults of its level
+        void release( ICompressor* compressor );
+        // Creates count contexts ahead of the first requests
+        void reserve( uint32_t compression_level, uint32_t count );
+    };
+
+    CompressorPool* CompressorPoolFactory();
+    void CompressorPoolDestroy( CompressorPool* pool );
+
     /*
      * Decompressor interface
      */
     class IDecompressor {
     protected:
+        uint32_t nThreads;
+        bool interleaved;
+        uint32_t blockBits;
+        bool linked;
+        bool primed;
+        uint8_t *dictionary;
+        uint32_t dictSize;
+        uint32_t dictId;
+        uint8_t *window;
+        uint32_t windowBits;
+        bool windowLoaded;
         virtual void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) = 0;
+        // Multi-stream kernel: decodes streams() blocks laid out in one arena in lock-step
+        virtual uint32_t streams() { return 1; }
+        virtual void decodeStreams( uint8_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t* ) {}
         void decodeFinalSafeInternal( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize );
+        // Scalar decoder for the blocks flagged with escapes: far offsets and long tokens.
+        // Offsets may reach the prefix bytes before outbuff, the end of the previous block of linked streams.
+        void decodeEscapes( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize, uint32_t prefix = 0 );
+        bool readFrameHeader( const uint8_t *header );
+        bool checkDictionary( const uint8_t *id );
+        void decompressParallel(IReader* reader, IWriter* writer, const uint8_t *first);
     public:
-        virtual ~IDecompressor() {}
+        IDecompressor() : nThreads( 1 ), interleaved( false ), blockBits( DEFAULT_BLOCK_BITS ), linked( false ), primed( false ), dictionary( nullptr ), dictSize( 0 ), dictId( 0 ), window( nullptr ), windowBits( 0 ), windowLoaded( false ) {}
+        virtual ~IDecompressor();
+        // Blocks are decoded concurrently by n_threads threads
+        void setThreads( uint32_t n_threads ) { nThreads = n_threads > 1 ? n_threads : 1; }
+        // Batches of blocks are decoded together by the multi-stream kernel, when the decoder has one
+        void setInterleaved( bool interleave ) { interleaved = interleave; }
+        // The dictionary the stream was compressed with, streams using another one are refused
+        void setDictionary( const uint8_t* dict, size_t size );
+        // Linked streams and streams with a dictionary are decoded by one thread, the previous block or the dictionary
+        // being needed in front of each block
         void decompress(IReader* reader, IWriter* writer);
+        // Memory to memory, returns the decompressed size or 0 when src is corrupt or dst too small
+        size_t decompress( const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity );
     };
 
-    IDecompressor* DecompressorFactory();
+    IDecompressor* DecompressorFactory( uint32_t n_threads = 1, bool interleaved = false );
     void DecompressorDestroy( IDecompressor* decompressor );
 
+    /*
+     * One-shot memory to memory API. Passing a context avoids its allocation on every call.
+     */
+    // Largest compressed size for inputSize bytes
+    size_t compressBound( size_t inputSize );
+    size_t compress( const char* src, size_t srcSize, char* dst, size_t dstCapacity, uint32_t compression_level = 0 );
+    size_t compress( ICompressor* compressor, const char* src, size_t srcSize, char* dst, size_t dstCapacity );
+    size_t decompress( const char* src, size_t srcSize, char* dst, size_t dstCapacity );
+    size_t decompress( IDecompressor* decompressor, const char* src, size_t srcSize, char* dst, size_t dstCapacity );
+
+    /*
+     * Dictionary training: the segments shared by the most samples, the most useful last.
+     * Returns the dictionary size, at most dictCapacity and MAX_DICTIONARY_SIZE.
+     */
+    size_t trainDictionary( const char* samples, const size_t* sampleSizes, uint32_t nSamples, char* dict, size_t dictCapacity );
+
 }
 
 
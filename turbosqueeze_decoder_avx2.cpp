@@ -36,45 +36,45 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstring>
 #include <cassert>
 
+#include "turbosqueeze.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
 #if _MSC_VER
 #include <intrin.h>
+#define TURBOSQUEEZE_TARGET_AVX2
 #else
 #include <x86intrin.h>
+// The functions of this file are compiled for AVX2 only, they are selected at run time by DecompressorFactory
+#define TURBOSQUEEZE_TARGET_AVX2 __attribute__((target("avx2")))
 #endif
 
 
-#include "turbosqueeze.h"
-
-
-#ifdef __AVX2__
-
-static __m256i constant_0 = _mm256_set1_epi32( 0 );
-static __m256i constant_1 = _mm256_set1_epi32( 1 );
-static __m256i constant_2 = _mm256_set1_epi32( 2 );
-static __m256i constant_3 = _mm256_set1_epi32( 3 );
-static __m256i constant_15 = _mm256_set1_epi32( 15 );
-static __m256i constant_128 = _mm256_set1_epi32( 128 );
-static __m256i constant_255 = _mm256_set1_epi32( 255 );
-static __m256i constant_256 = _mm256_set1_epi32( 256 );
-static __m256i constant_65535 = _mm256_set1_epi32( 65535 );
-
-
-static inline __m256i _mm256_i32gather_u8_to_epi32( void* memory, __m256i indices )
+static inline TURBOSQUEEZE_TARGET_AVX2 __m256i _mm256_i32gather_u8_to_epi32( void* memory, __m256i indices )
 {
+    const __m256i constant_3 = _mm256_set1_epi32( 3 );
+    const __m256i constant_255 = _mm256_set1_epi32( 255 );
+
     return _mm256_and_si256( _mm256_srlv_epi32( _mm256_i32gather_epi32( (int*) memory, _mm256_srli_epi32( indices, 2 ), 4 ), _mm256_slli_epi32( _mm256_and_si256( indices, constant_3 ), 3 ) ), constant_255 );
 }
 
-static inline __m256i _mm256_select_epi32( __m256i a, __m256i b, __m256i mask )
+static inline TURBOSQUEEZE_TARGET_AVX2 __m256i _mm256_select_epi32( __m256i a, __m256i b, __m256i mask )
 {
     return _mm256_or_si256(_mm256_and_si256( a, mask ), _mm256_andnot_si256( mask, b ));
 }
 
-#endif
 
-
-extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputStart[8], uint32_t inputSize[8], uint32_t outputStart[8], uint32_t outputSize[8], uint32_t last_i )
+extern "C" TURBOSQUEEZE_TARGET_AVX2 void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputStart[8], uint32_t inputSize[8], uint32_t outputStart[8], uint32_t outputSize[8], uint32_t last_i )
 {
-#ifdef __AVX2__
+    const __m256i constant_0 = _mm256_set1_epi32( 0 );
+    const __m256i constant_1 = _mm256_set1_epi32( 1 );
+    const __m256i constant_2 = _mm256_set1_epi32( 2 );
+    const __m256i constant_15 = _mm256_set1_epi32( 15 );
+    const __m256i constant_128 = _mm256_set1_epi32( 128 );
+    const __m256i constant_255 = _mm256_set1_epi32( 255 );
+    const __m256i constant_256 = _mm256_set1_epi32( 256 );
+    const __m256i constant_65535 = _mm256_set1_epi32( 65535 );
 
     // Initialization
     __m256i i = _mm256_loadu_si256((__m256i*) &inputStart[0]);
@@ -112,14 +112,14 @@ extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputS
             } dst;
             _mm256_store_si256( (__m256i*) &dst.j, j );
 
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[0]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[0]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[1]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[1]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[2]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[2]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[3]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[3]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[4]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[4]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[5]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[5]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[6]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[6]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[7]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[7]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[0]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[0]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[1]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[1]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[2]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[2]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[3]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[3]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[4]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[4]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[5]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[5]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[6]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[6]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[7]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[7]) ));
 
             i = _mm256_add_epi32( i, _mm256_select_epi32( sz1, constant_2, rep1 ) );
             j = _mm256_add_epi32( j, sz1 );
@@ -132,14 +132,14 @@ extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputS
             _mm256_store_si256( (__m256i*) &src.src1, _mm256_select_epi32( i, _mm256_sub_epi32( base, offset2 ), rep2 ) );
             _mm256_store_si256( (__m256i*) &dst.j, j );
 
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[0]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[0]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[1]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[1]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[2]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[2]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[3]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[3]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[4]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[4]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[5]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[5]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[6]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[6]) ));
-            _mm_storeu_si128( (__m128i_u*) (memory+dst.j8[7]), _mm_lddqu_si128( (__m128i_u*) (memory+src.src8[7]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[0]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[0]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[1]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[1]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[2]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[2]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[3]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[3]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[4]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[4]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[5]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[5]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[6]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[6]) ));
+            _mm_storeu_si128( (__m128i*) (memory+dst.j8[7]), _mm_lddqu_si128( (__m128i*) (memory+src.src8[7]) ));
 
             i = _mm256_add_epi32( i, _mm256_select_epi32( sz2, constant_2, rep2 ) );
             j = _mm256_add_epi32( j, sz2 );
@@ -191,7 +191,7 @@ extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputS
 
                 uint8_t *src1 = rep1 ? &memory[base-offset1] : &memory[ii];
 
-                _mm_storeu_si128( (__m128i_u*) (memory+jj), _mm_lddqu_si128( (__m128i_u*) src1 ));
+                _mm_storeu_si128( (__m128i*) (memory+jj), _mm_lddqu_si128( (__m128i*) src1 ));
 
                 ii += rep1 ? 2 : sz1;
                 jj += sz1;
@@ -205,7 +205,7 @@ extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputS
 
                 uint8_t *src2 = rep2 ? &memory[base-offset2] : &memory[ii];
 
-                _mm_storeu_si128( (__m128i_u*) (memory+jj), _mm_lddqu_si128( (__m128i_u*) src2 ));
+                _mm_storeu_si128( (__m128i*) (memory+jj), _mm_lddqu_si128( (__m128i*) src2 ));
 
                 ii += rep2 ? 2 : sz2;
                 jj += sz2;
@@ -268,13 +268,14 @@ extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputS
     }
 
     //*outputSize = size;
-#endif
 }
 
 
-#define TURBOSQUEEZE_BLOCK_BITS (18)
-#define TURBOSQUEEZE_BLOCK_SZ (1<<TURBOSQUEEZE_BLOCK_BITS)
-#define TURBOSQUEEZE_OUTPUT_SZ ((1<<TURBOSQUEEZE_BLOCK_BITS) + (1<<(TURBOSQUEEZE_BLOCK_BITS-2)))
+// Largest block, the stream code checks the sizes against the block size of the frame
+#define TURBOSQUEEZE_MAX_BLOCK_SZ (1u<<MAX_BLOCK_BITS)
+
+// The last bytes of a block are decoded exactly, so no wild copy goes past the end of the block
+#define TURBOSQUEEZE_TAIL_SZ (256)
 
 
 namespace TurboSqueeze {
@@ -283,23 +284,31 @@ namespace TurboSqueeze {
     class AVX2Decompressor : public IDecompressor {
     public:
         void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override { return 8; }
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
     };
 
 
+    // 8 blocks in lock-step, the streams reaching their last bytes are completed by the kernel tail code
+    void AVX2Decompressor::decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize )
+    {
+        turbosqueezeDecodeInternalAVX2( arena, inputStart, inputSize, outputStart, outputSize, 8 );
+    }
+
+
     // Decompressor
-    void AVX2Decompressor::decode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
+    TURBOSQUEEZE_TARGET_AVX2 void AVX2Decompressor::decode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
     {
         uint32_t size = *outputSize;
 
         *outputSize = 0;
 
-#ifdef __AVX2__
         // Corrupt data?
-        if (size > TURBOSQUEEZE_BLOCK_SZ) return;
+        if (size > TURBOSQUEEZE_MAX_BLOCK_SZ) return;
 
         uint32_t i=0, j=0;
 
-        while (j < size)
+        while (j + TURBOSQUEEZE_TAIL_SZ < size)
         {
             uint8_t ctrl_byte = inputBlock[i]; i++;
             uint32_t ctrl_mask = 1 << 7;
@@ -316,9 +325,9 @@ namespace TurboSqueeze {
 
                 bool rep1 = (ctrl_byte & ctrl_mask) != 0;
 
-                uint8_t *src1 = rep1 ? &outputBlock[base-offset1] : &inputBlock[i];
+                uint8_t *src1 = rep1 ? outputBlock + base - offset1 : &inputBlock[i];
 
-                _mm_storeu_si128( (__m128i_u*) &outputBlock[j], _mm_lddqu_si128( (__m128i_u*) src1 ));
+                _mm_storeu_si128( (__m128i*) &outputBlock[j], _mm_lddqu_si128( (__m128i*) src1 ));
 
                 i += rep1 ? 2 : sz1;
                 j += sz1;
@@ -330,9 +339,9 @@ namespace TurboSqueeze {
                 uint32_t sz2 = (ctr & 0xF) + 1;
                 uint32_t offset2 = *((uint16_t*) (&inputBlock[i]));
 
-                uint8_t *src2 = rep2 ? &outputBlock[base-offset2] : &inputBlock[i];
+                uint8_t *src2 = rep2 ? outputBlock + base - offset2 : &inputBlock[i];
 
-                _mm_storeu_si128( (__m128i_u*) &outputBlock[j], _mm_lddqu_si128( (__m128i_u*) src2 ));
+                _mm_storeu_si128( (__m128i*) &outputBlock[j], _mm_lddqu_si128( (__m128i*) src2 ));
 
                 i += rep2 ? 2 : sz2;
                 j += sz2;
@@ -341,11 +350,16 @@ namespace TurboSqueeze {
             }
         }
 
-        *outputSize = size;
-#endif
+        // Last bytes of the block
+        uint32_t tail = size - j;
+        decodeFinalSafeInternal( inputBlock+i, outputBlock+j, &tail, i < inputSize ? inputSize-i : 0 );
+
+        *outputSize = j + tail;
     }
 
 
 }
 
+#endif
+
 
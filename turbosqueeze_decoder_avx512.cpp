@@ -0,0 +1,362 @@
+/*
+Libturbosqueeze TurboSqueeze avx-512 decoder.
+
+BSD 3-Clause License
+
+Copyright (c) 2024, Julien Perrier-cornet
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "turbosqueeze.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#if _MSC_VER
+#include <intrin.h>
+#define TURBOSQUEEZE_TARGET_AVX512
+#define turbosqueeze_popcount( A ) __popcnt( A )
+#else
+#include <x86intrin.h>
+// The functions of this file are compiled for AVX-512 only, they are selected at run time by DecompressorFactory
+#define TURBOSQUEEZE_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+#define turbosqueeze_popcount( A ) __builtin_popcount( A )
+#endif
+
+
+// Copies size bytes (1 to 16) with masked accesses, nothing is read or written past size
+static inline TURBOSQUEEZE_TARGET_AVX512 void copyMasked( uint8_t *dst, const uint8_t *src, uint32_t size )
+{
+    __mmask16 mask = (__mmask16) ((1u << size) - 1);
+
+    _mm_mask_storeu_epi8( dst, mask, _mm_maskz_loadu_epi8( mask, src ) );
+}
+
+
+static inline TURBOSQUEEZE_TARGET_AVX512 void copy16( uint8_t *dst, const uint8_t *src )
+{
+    _mm_storeu_si128( (__m128i*) dst, _mm_loadu_si128( (const __m128i*) src ) );
+}
+
+
+// Exact decoding from output position j to size, input points to the current control byte and holds inputSize bytes.
+// Returns the output position reached, short of size when the input ends first.
+static TURBOSQUEEZE_TARGET_AVX512 uint32_t decodeTailAVX512( uint8_t *input, uint8_t *output, uint32_t j, uint32_t size, uint32_t inputSize )
+{
+    uint32_t i = 0;
+
+    while (j < size && i < inputSize)
+    {
+        uint8_t ctrl_byte = input[i++];
+        uint32_t ctrl_mask = 1 << 7;
+
+        while (j < size && ctrl_mask)
+        {
+            uint32_t base = j;
+
+            if (i >= inputSize) return j;
+            uint8_t ctr = input[i++];
+
+            uint32_t sz1 = (ctr >> 4) + 1;
+            bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+
+            // Corrupt data?
+            if ((rep1 ? 2 : sz1) > inputSize-i) return j;
+            uint8_t *src1 = rep1 ? output + base - *((uint16_t*) (&input[i])) : &input[i];
+
+            if (sz1 > size-j) sz1 = size-j;
+            copyMasked( output+j, src1, sz1 );
+
+            i += rep1 ? 2 : sz1;
+            j += sz1;
+
+            if (j >= size) break;
+
+            ctrl_mask >>= 1;
+
+            bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+            uint32_t sz2 = (ctr & 0xF) + 1;
+
+            if ((rep2 ? 2 : sz2) > inputSize-i) return j;
+            uint8_t *src2 = rep2 ? output + base - *((uint16_t*) (&input[i])) : &input[i];
+
+            if (sz2 > size-j) sz2 = size-j;
+            copyMasked( output+j, src2, sz2 );
+
+            i += rep2 ? 2 : sz2;
+            j += sz2;
+
+            ctrl_mask >>= 1;
+        }
+    }
+
+    return j;
+}
+
+
+extern "C" TURBOSQUEEZE_TARGET_AVX512 void turbosqueezeDecodeInternalAVX512( uint8_t *memory, uint32_t inputStart[16], uint32_t inputSize[16], uint32_t outputStart[16], uint32_t outputSize[16], uint32_t last_i )
+{
+    const __m512i constant_0 = _mm512_set1_epi32( 0 );
+    const __m512i constant_1 = _mm512_set1_epi32( 1 );
+    const __m512i constant_2 = _mm512_set1_epi32( 2 );
+    const __m512i constant_15 = _mm512_set1_epi32( 15 );
+    const __m512i constant_128 = _mm512_set1_epi32( 128 );
+    const __m512i constant_255 = _mm512_set1_epi32( 255 );
+    const __m512i constant_256 = _mm512_set1_epi32( 256 );
+    const __m512i constant_65535 = _mm512_set1_epi32( 65535 );
+
+    // Initialization
+    __m512i i = _mm512_loadu_si512( inputStart );
+    __m512i j = _mm512_loadu_si512( outputStart );
+    __m512i tmpsize = _mm512_loadu_si512( outputSize );
+    // We stop at least one block before the end to decode the end safely
+    __m512i sizem = _mm512_sub_epi32( _mm512_add_epi32( j, tmpsize ), constant_256 );
+
+    // Streams reaching their last bytes are masked out, the vector loop runs while at least half of them are active
+    __mmask16 active = _mm512_cmpgt_epi32_mask( sizem, j );
+
+    int32_t src[16];
+    int32_t dst[16];
+
+    while (turbosqueeze_popcount( active ) >= 8)
+    {
+        __m512i control_byte = _mm512_mask_i32gather_epi32( constant_0, active, i, memory, 1 );
+        i = _mm512_mask_add_epi32( i, active, i, constant_1 );
+        __m512i control_mask = constant_128;
+
+        for (uint32_t k=0; k<4; k++)
+        {
+            __m512i base = j;
+            __m512i counter = _mm512_and_si512( _mm512_mask_i32gather_epi32( constant_0, active, i, memory, 1 ), constant_255 );
+            i = _mm512_mask_add_epi32( i, active, i, constant_1 );
+
+            __m512i sz1 = _mm512_add_epi32( _mm512_srli_epi32( counter, 4 ), constant_1 );
+            __m512i offset1 = _mm512_and_si512( _mm512_mask_i32gather_epi32( constant_0, active, i, memory, 1 ), constant_65535 );
+            __mmask16 lit1 = _mm512_testn_epi32_mask( control_byte, control_mask );
+
+            // Inactive streams copy their current position onto itself
+            _mm512_storeu_si512( src, _mm512_mask_blend_epi32( active, j, _mm512_mask_blend_epi32( lit1, _mm512_sub_epi32( base, offset1 ), i ) ) );
+            _mm512_storeu_si512( dst, j );
+
+            for (uint32_t n=0; n<16; n++)
+                copy16( memory+dst[n], memory+src[n] );
+
+            i = _mm512_mask_add_epi32( i, active, i, _mm512_mask_blend_epi32( lit1, constant_2, sz1 ) );
+            j = _mm512_mask_add_epi32( j, active, j, sz1 );
+            control_mask = _mm512_srli_epi32( control_mask, 1 );
+
+            __m512i sz2 = _mm512_add_epi32( _mm512_and_si512( counter, constant_15 ), constant_1 );
+            __m512i offset2 = _mm512_and_si512( _mm512_mask_i32gather_epi32( constant_0, active, i, memory, 1 ), constant_65535 );
+            __mmask16 lit2 = _mm512_testn_epi32_mask( control_byte, control_mask );
+
+            _mm512_storeu_si512( src, _mm512_mask_blend_epi32( active, j, _mm512_mask_blend_epi32( lit2, _mm512_sub_epi32( base, offset2 ), i ) ) );
+            _mm512_storeu_si512( dst, j );
+
+            for (uint32_t n=0; n<16; n++)
+                copy16( memory+dst[n], memory+src[n] );
+
+            i = _mm512_mask_add_epi32( i, active, i, _mm512_mask_blend_epi32( lit2, constant_2, sz2 ) );
+            j = _mm512_mask_add_epi32( j, active, j, sz2 );
+            control_mask = _mm512_srli_epi32( control_mask, 1 );
+        }
+
+        active = _mm512_mask_cmpgt_epi32_mask( active, sizem, j );
+    }
+
+    // Complete remaining streams
+    int32_t iind[16];
+    int32_t jind[16];
+    int32_t end[16];
+
+    _mm512_storeu_si512( iind, i );
+    _mm512_storeu_si512( jind, j );
+    _mm512_storeu_si512( end, sizem );
+
+    for (uint32_t k=0; k<last_i; k++)
+    {
+        uint32_t ii = iind[k];
+        uint32_t jj = jind[k];
+        uint32_t size = end[k];
+
+        while (jj < size)
+        {
+            uint8_t ctrl_byte = memory[ii]; ii++;
+            uint32_t ctrl_mask = 1 << 7;
+
+            while (ctrl_mask)
+            {
+                uint32_t base = jj;
+
+                uint8_t ctr = memory[ii]; ii++;
+
+                uint32_t sz1 = (ctr >> 4) + 1;
+                uint32_t offset1 = *((uint16_t*) (&memory[ii]));
+
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+
+                copy16( memory+jj, rep1 ? &memory[base-offset1] : &memory[ii] );
+
+                ii += rep1 ? 2 : sz1;
+                jj += sz1;
+
+                ctrl_mask >>= 1;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint32_t sz2 = (ctr & 0xF) + 1;
+                uint32_t offset2 = *((uint16_t*) (&memory[ii]));
+
+                copy16( memory+jj, rep2 ? &memory[base-offset2] : &memory[ii] );
+
+                ii += rep2 ? 2 : sz2;
+                jj += sz2;
+
+                ctrl_mask >>= 1;
+            }
+        }
+
+        // Safe decoding the end of the stream (last 256 bytes or less) with masked copies of the exact size
+        uint32_t inputEnd = inputStart[k] + inputSize[k];
+        jj = decodeTailAVX512( memory+ii, memory, jj, outputStart[k] + outputSize[k], ii < inputEnd ? inputEnd-ii : 0 );
+
+        outputSize[k] = jj - outputStart[k];
+    }
+}
+
+
+// Largest block, the stream code checks the sizes against the block size of the frame
+#define TURBOSQUEEZE_MAX_BLOCK_SZ (1u<<MAX_BLOCK_BITS)
+
+// The last bytes of a block are decoded exactly, so no wild copy goes past the end of the block
+#define TURBOSQUEEZE_TAIL_SZ (256)
+
+// Input read by one control byte of the main loop at most: the size bytes and 16-byte literal copies
+#define TURBOSQUEEZE_GROUP_SZ (1 + 4 + 8*16)
+
+
+// The 16-lane kernel keeps 32 sequential streams in flight, on the cores tested this is past what the
+// hardware prefetchers track and the 8-lane AVX2 kernel is faster, so it is only used when asked for
+#ifdef TURBOSQUEEZE_WIDE_STREAMS
+#define TURBOSQUEEZE_AVX512_STREAMS (16)
+#else
+#define TURBOSQUEEZE_AVX512_STREAMS (8)
+extern "C" void turbosqueezeDecodeInternalAVX2( uint8_t *memory, uint32_t inputStart[8], uint32_t inputSize[8], uint32_t outputStart[8], uint32_t outputSize[8], uint32_t last_i );
+#endif
+
+
+namespace TurboSqueeze {
+
+
+    class AVX512Decompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override;
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
+    };
+
+
+    // Lane count depends on the build option, so it is not defined inline in the class
+    uint32_t AVX512Decompressor::streams()
+    {
+        return TURBOSQUEEZE_AVX512_STREAMS;
+    }
+
+
+    void AVX512Decompressor::decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize )
+    {
+#ifdef TURBOSQUEEZE_WIDE_STREAMS
+        turbosqueezeDecodeInternalAVX512( arena, inputStart, inputSize, outputStart, outputSize, 16 );
+#else
+        turbosqueezeDecodeInternalAVX2( arena, inputStart, inputSize, outputStart, outputSize, 8 );
+#endif
+    }
+
+
+    // Decompressor
+    TURBOSQUEEZE_TARGET_AVX512 void AVX512Decompressor::decode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
+    {
+        uint32_t size = *outputSize;
+
+        *outputSize = 0;
+
+        // Corrupt data?
+        if (size > TURBOSQUEEZE_MAX_BLOCK_SZ) return;
+
+        uint32_t i=0, j=0;
+
+        // The tail also takes over when the input runs short, on corrupt blocks
+        while (j + TURBOSQUEEZE_TAIL_SZ < size && i + TURBOSQUEEZE_GROUP_SZ <= inputSize)
+        {
+            uint8_t ctrl_byte = inputBlock[i]; i++;
+            uint32_t ctrl_mask = 1 << 7;
+
+            for (uint32_t k=0; k<4; k++)
+            {
+                uint32_t base = j;
+
+                uint8_t ctr = inputBlock[i]; i++;
+
+                uint32_t sz1 = (ctr >> 4) + 1;
+                uint32_t offset1 = *((uint16_t*) (&inputBlock[i]));
+
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+
+                copy16( &outputBlock[j], rep1 ? outputBlock + base - offset1 : &inputBlock[i] );
+
+                i += rep1 ? 2 : sz1;
+                j += sz1;
+
+                ctrl_mask >>= 1;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint32_t sz2 = (ctr & 0xF) + 1;
+                uint32_t offset2 = *((uint16_t*) (&inputBlock[i]));
+
+                copy16( &outputBlock[j], rep2 ? outputBlock + base - offset2 : &inputBlock[i] );
+
+                i += rep2 ? 2 : sz2;
+                j += sz2;
+
+                ctrl_mask >>= 1;
+            }
+        }
+
+        // Last bytes of the block
+        *outputSize = decodeTailAVX512( inputBlock+i, outputBlock, j, size, i < inputSize ? inputSize-i : 0 );
+    }
+
+
+}
+
+#endif
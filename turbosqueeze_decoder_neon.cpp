@@ -0,0 +1,357 @@
+/*
+Libturbosqueeze TurboSqueeze neon decoder.
+
+BSD 3-Clause License
+
+Copyright (c) 2024, Julien Perrier-cornet
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "turbosqueeze.h"
+
+
+// NEON is part of the aarch64 base ISA, so this decoder needs no run time check
+#if defined(__aarch64__) || defined(_M_ARM64)
+
+#include <arm_neon.h>
+
+
+// No gather instruction in NEON: the lane loads are scalar, the lane arithmetic stays in vectors
+static inline uint32x4_t gather_u8( const uint8_t *memory, uint32x4_t indices )
+{
+    uint32_t ind[4];
+    vst1q_u32( ind, indices );
+
+    uint32x4_t r = vdupq_n_u32( memory[ind[0]] );
+    r = vsetq_lane_u32( memory[ind[1]], r, 1 );
+    r = vsetq_lane_u32( memory[ind[2]], r, 2 );
+    r = vsetq_lane_u32( memory[ind[3]], r, 3 );
+    return r;
+}
+
+static inline uint32x4_t gather_u16( const uint8_t *memory, uint32x4_t indices )
+{
+    uint32_t ind[4];
+    vst1q_u32( ind, indices );
+
+    uint32x4_t r = vdupq_n_u32( *((uint16_t*) (memory+ind[0])) );
+    r = vsetq_lane_u32( *((uint16_t*) (memory+ind[1])), r, 1 );
+    r = vsetq_lane_u32( *((uint16_t*) (memory+ind[2])), r, 2 );
+    r = vsetq_lane_u32( *((uint16_t*) (memory+ind[3])), r, 3 );
+    return r;
+}
+
+static inline void copy16x4( uint8_t *memory, uint32x4_t dst, uint32x4_t src )
+{
+    uint32_t d[4], s[4];
+    vst1q_u32( d, dst );
+    vst1q_u32( s, src );
+
+    vst1q_u8( memory+d[0], vld1q_u8( memory+s[0] ) );
+    vst1q_u8( memory+d[1], vld1q_u8( memory+s[1] ) );
+    vst1q_u8( memory+d[2], vld1q_u8( memory+s[2] ) );
+    vst1q_u8( memory+d[3], vld1q_u8( memory+s[3] ) );
+}
+
+
+// 8 streams as two halves of 4 lanes
+extern "C" void turbosqueezeDecodeInternalNEON( uint8_t *memory, uint32_t inputStart[8], uint32_t inputSize[8], uint32_t outputStart[8], uint32_t outputSize[8], uint32_t last_i )
+{
+    const uint32x4_t constant_1 = vdupq_n_u32( 1 );
+    const uint32x4_t constant_2 = vdupq_n_u32( 2 );
+    const uint32x4_t constant_15 = vdupq_n_u32( 15 );
+    const uint32x4_t constant_256 = vdupq_n_u32( 256 );
+
+    // Initialization
+    uint32x4_t i[2] = { vld1q_u32( &inputStart[0] ), vld1q_u32( &inputStart[4] ) };
+    uint32x4_t j[2] = { vld1q_u32( &outputStart[0] ), vld1q_u32( &outputStart[4] ) };
+    // We stop at least one block before the end to decode the end safely
+    uint32x4_t sizem[2] = {
+        vsubq_u32( vaddq_u32( j[0], vld1q_u32( &outputSize[0] ) ), constant_256 ),
+        vsubq_u32( vaddq_u32( j[1], vld1q_u32( &outputSize[4] ) ), constant_256 )
+    };
+
+    while (vminvq_u32( vandq_u32(
+        vcgtq_s32( vreinterpretq_s32_u32( sizem[0] ), vreinterpretq_s32_u32( j[0] ) ),
+        vcgtq_s32( vreinterpretq_s32_u32( sizem[1] ), vreinterpretq_s32_u32( j[1] ) ) ) ) != 0)
+    {
+        uint32x4_t control_byte[2];
+
+        for (uint32_t h=0; h<2; h++)
+        {
+            control_byte[h] = gather_u8( memory, i[h] );
+            i[h] = vaddq_u32( i[h], constant_1 );
+        }
+
+        uint32_t control_mask = 128;
+
+        for (uint32_t k=0; k<4; k++)
+        {
+            uint32x4_t base[2], counter[2];
+
+            for (uint32_t h=0; h<2; h++)
+            {
+                base[h] = j[h];
+                counter[h] = gather_u8( memory, i[h] );
+                i[h] = vaddq_u32( i[h], constant_1 );
+
+                uint32x4_t sz1 = vaddq_u32( vshrq_n_u32( counter[h], 4 ), constant_1 );
+                uint32x4_t offset1 = gather_u16( memory, i[h] );
+                uint32x4_t rep1 = vtstq_u32( control_byte[h], vdupq_n_u32( control_mask ) );
+
+                copy16x4( memory, j[h], vbslq_u32( rep1, vsubq_u32( base[h], offset1 ), i[h] ) );
+
+                i[h] = vaddq_u32( i[h], vbslq_u32( rep1, constant_2, sz1 ) );
+                j[h] = vaddq_u32( j[h], sz1 );
+            }
+
+            control_mask >>= 1;
+
+            for (uint32_t h=0; h<2; h++)
+            {
+                uint32x4_t sz2 = vaddq_u32( vandq_u32( counter[h], constant_15 ), constant_1 );
+                uint32x4_t offset2 = gather_u16( memory, i[h] );
+                uint32x4_t rep2 = vtstq_u32( control_byte[h], vdupq_n_u32( control_mask ) );
+
+                copy16x4( memory, j[h], vbslq_u32( rep2, vsubq_u32( base[h], offset2 ), i[h] ) );
+
+                i[h] = vaddq_u32( i[h], vbslq_u32( rep2, constant_2, sz2 ) );
+                j[h] = vaddq_u32( j[h], sz2 );
+            }
+
+            control_mask >>= 1;
+        }
+    }
+
+    // Complete remaining streams
+    uint32_t iind[8], jind[8], end[8];
+
+    vst1q_u32( &iind[0], i[0] ); vst1q_u32( &iind[4], i[1] );
+    vst1q_u32( &jind[0], j[0] ); vst1q_u32( &jind[4], j[1] );
+    vst1q_u32( &end[0], sizem[0] ); vst1q_u32( &end[4], sizem[1] );
+
+    for (uint32_t k=0; k<last_i; k++)
+    {
+        uint32_t ii = iind[k];
+        uint32_t jj = jind[k];
+        uint32_t size = end[k];
+
+        while (jj < size)
+        {
+            uint8_t ctrl_byte = memory[ii]; ii++;
+            uint32_t ctrl_mask = 1 << 7;
+
+            while (ctrl_mask)
+            {
+                uint32_t base = jj;
+
+                uint8_t ctr = memory[ii]; ii++;
+
+                uint32_t sz1 = (ctr >> 4) + 1;
+                uint32_t offset1 = *((uint16_t*) (&memory[ii]));
+
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint8_t *src1 = rep1 ? &memory[base-offset1] : &memory[ii];
+
+                vst1q_u8( memory+jj, vld1q_u8( src1 ) );
+
+                ii += rep1 ? 2 : sz1;
+                jj += sz1;
+
+                ctrl_mask >>= 1;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint32_t sz2 = (ctr & 0xF) + 1;
+                uint32_t offset2 = *((uint16_t*) (&memory[ii]));
+
+                uint8_t *src2 = rep2 ? &memory[base-offset2] : &memory[ii];
+
+                vst1q_u8( memory+jj, vld1q_u8( src2 ) );
+
+                ii += rep2 ? 2 : sz2;
+                jj += sz2;
+
+                ctrl_mask >>= 1;
+            }
+        }
+
+        iind[k] = ii;
+        jind[k] = jj;
+    }
+
+    // Safe decoding the end of the stream (last 256 bytes or less) using memcpy and exact size
+
+    for (uint32_t k=0; k<last_i; k++)
+    {
+        uint32_t ii = iind[k];
+        uint32_t jj = jind[k];
+        uint32_t size = outputStart[k] + outputSize[k];
+
+        while (jj < size)
+        {
+            uint8_t ctrl_byte = memory[ii++];
+            uint32_t ctrl_mask = 1 << 7;
+
+            while (jj < size && ctrl_mask)
+            {
+                uint32_t base = jj;
+
+                uint8_t ctr = memory[ii++];
+
+                uint32_t sz1 = (ctr >> 4) + 1;
+                uint32_t offset1 = *((uint16_t*) (&memory[ii]));
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+                uint8_t *src1 = rep1 ? &memory[base-offset1] : &memory[ii];
+
+                memcpy( memory+jj, src1, sz1 );
+
+                ii += rep1 ? 2 : sz1;
+                jj += sz1;
+
+                if (jj >= size) break;
+
+                ctrl_mask >>= 1;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+                uint32_t sz2 = (ctr & 0xF) + 1;
+                uint32_t offset2 = *((uint16_t*) (&memory[ii]));
+                uint8_t *src2 = rep2 ? &memory[base-offset2] : &memory[ii];
+
+                memcpy( memory+jj, src2, sz2 );
+
+                ii += rep2 ? 2 : sz2;
+                jj += sz2;
+
+                ctrl_mask >>= 1;
+            }
+        }
+    }
+}
+
+
+// Largest block, the stream code checks the sizes against the block size of the frame
+#define TURBOSQUEEZE_MAX_BLOCK_SZ (1u<<MAX_BLOCK_BITS)
+
+// The last bytes of a block are decoded exactly, so no wild copy goes past the end of the block
+#define TURBOSQUEEZE_TAIL_SZ (256)
+
+// Input read by one control byte of the main loop at most: the size bytes and 16-byte literal copies
+#define TURBOSQUEEZE_GROUP_SZ (1 + 4 + 8*16)
+
+
+namespace TurboSqueeze {
+
+
+    class NEONDecompressor : public IDecompressor {
+    public:
+        void decode( uint8_t *inbuff, uint8_t *outbuff, uint32_t *outputSize, uint32_t inputSize ) override;
+        uint32_t streams() override { return 8; }
+        void decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize ) override;
+    };
+
+
+    // 8 blocks in lock-step, the streams reaching their last bytes are completed by the kernel tail code
+    void NEONDecompressor::decodeStreams( uint8_t *arena, uint32_t *inputStart, uint32_t *inputSize, uint32_t *outputStart, uint32_t *outputSize )
+    {
+        turbosqueezeDecodeInternalNEON( arena, inputStart, inputSize, outputStart, outputSize, 8 );
+    }
+
+
+    // Decompressor
+    void NEONDecompressor::decode( uint8_t *inputBlock, uint8_t *outputBlock, uint32_t *outputSize, uint32_t inputSize )
+    {
+        uint32_t size = *outputSize;
+
+        *outputSize = 0;
+
+        // Corrupt data?
+        if (size > TURBOSQUEEZE_MAX_BLOCK_SZ) return;
+
+        uint32_t i=0, j=0;
+
+        // The tail also takes over when the input runs short, on corrupt blocks
+        while (j + TURBOSQUEEZE_TAIL_SZ < size && i + TURBOSQUEEZE_GROUP_SZ <= inputSize)
+        {
+            uint8_t ctrl_byte = inputBlock[i]; i++;
+            uint32_t ctrl_mask = 1 << 7;
+
+            #pragma unroll 4
+            for (uint32_t k=0; k<4; k++)
+            {
+                uint32_t base = j;
+
+                uint8_t ctr = inputBlock[i]; i++;
+
+                uint32_t sz1 = (ctr >> 4) + 1;
+                uint32_t offset1 = *((uint16_t*) (&inputBlock[i]));
+
+                bool rep1 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint8_t *src1 = rep1 ? outputBlock + base - offset1 : &inputBlock[i];
+
+                vst1q_u8( &outputBlock[j], vld1q_u8( src1 ) );
+
+                i += rep1 ? 2 : sz1;
+                j += sz1;
+
+                ctrl_mask >>= 1;
+
+                bool rep2 = (ctrl_byte & ctrl_mask) != 0;
+
+                uint32_t sz2 = (ctr & 0xF) + 1;
+                uint32_t offset2 = *((uint16_t*) (&inputBlock[i]));
+
+                uint8_t *src2 = rep2 ? outputBlock + base - offset2 : &inputBlock[i];
+
+                vst1q_u8( &outputBlock[j], vld1q_u8( src2 ) );
+
+                i += rep2 ? 2 : sz2;
+                j += sz2;
+
+                ctrl_mask >>= 1;
+            }
+        }
+
+        // Last bytes of the block
+        uint32_t tail = size - j;
+        decodeFinalSafeInternal( inputBlock+i, outputBlock+j, &tail, i < inputSize ? inputSize-i : 0 );
+
+        *outputSize = j + tail;
+    }
+
+
+}
+
+#endif
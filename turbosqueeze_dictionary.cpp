@@ -0,0 +1,167 @@
+/*
+Libturbosqueeze TurboSqueeze dictionary training.
+
+BSD 3-Clause License
+
+Copyright (c) 2024, Julien Perrier-cornet
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "turbosqueeze.h"
+
+
+// Bytes hashed together when counting the samples sharing them, and length of the segments of the dictionary
+#define TURBOSQUEEZE_TRAIN_DMER (8)
+#define TURBOSQUEEZE_TRAIN_SEGMENT (64)
+#define TURBOSQUEEZE_TRAIN_HASH_BITS (20)
+
+
+namespace TurboSqueeze {
+
+
+    static inline uint32_t dmerHash( const char *data )
+    {
+        uint64_t v;
+        memcpy( &v, data, sizeof(v) );
+        return (uint32_t) ((v * 0x9E3779B97F4A7C15ull) >> (64 - TURBOSQUEEZE_TRAIN_HASH_BITS));
+    }
+
+    // The corpus is cut in one epoch per segment of the dictionary, the segment of each epoch with the most shared
+    // d-mers is kept. The d-mers of a kept segment no longer count, so the next segments bring other content.
+    size_t trainDictionary( const char* samples, const size_t* sampleSizes, uint32_t nSamples, char* dict, size_t dictCapacity )
+    {
+        if (samples == nullptr || sampleSizes == nullptr || dict == nullptr) return 0;
+
+        size_t capacity = dictCapacity < MAX_DICTIONARY_SIZE ? dictCapacity : MAX_DICTIONARY_SIZE;
+        size_t total = 0;
+
+        for (uint32_t s=0; s<nSamples; s++)
+            total += sampleSizes[s];
+
+        // Small corpora are their own dictionary
+        if (total <= capacity)
+        {
+            memcpy( dict, samples, total );
+            return total;
+        }
+
+        const uint32_t nSegments = capacity / TURBOSQUEEZE_TRAIN_SEGMENT;
+        if (nSegments == 0) return 0;
+
+        // Number of samples where each d-mer appears, the d-mers of one sample only are not shared
+        uint32_t *counts = new uint32_t [1 << TURBOSQUEEZE_TRAIN_HASH_BITS]();
+        uint32_t *seen = new uint32_t [1 << TURBOSQUEEZE_TRAIN_HASH_BITS]();
+        size_t *ends = new size_t [nSamples];
+        size_t start = 0;
+
+        for (uint32_t s=0; s<nSamples; s++)
+        {
+            for (size_t p=0; p+TURBOSQUEEZE_TRAIN_DMER<=sampleSizes[s]; p++)
+            {
+                uint32_t h = dmerHash( samples+start+p );
+
+                if (seen[h] != s+1)
+                {
+                    seen[h] = s+1;
+                    counts[h]++;
+                }
+            }
+
+            start += sampleSizes[s];
+            ends[s] = start;
+        }
+
+        for (uint32_t h=0; h<(1u << TURBOSQUEEZE_TRAIN_HASH_BITS); h++)
+            counts[h] = counts[h] > 1 ? counts[h] - 1 : 0;
+
+        // Hash of the d-mer at each position of the epoch, or none when it crosses the end of its sample
+        const size_t epochSize = total / nSegments;
+        std::vector<uint32_t> dmers( epochSize );
+        std::vector<std::pair<uint64_t,size_t>> segments;
+        uint32_t sample = 0;
+
+        for (uint32_t e=0; e<nSegments; e++)
+        {
+            size_t first = e * epochSize;
+
+            for (size_t q=0; q<epochSize; q++)
+            {
+                while (ends[sample] <= first+q) sample++;
+                dmers[q] = first+q+TURBOSQUEEZE_TRAIN_DMER <= ends[sample] ? dmerHash( samples+first+q ) + 1 : 0;
+            }
+
+            // Sliding sum over the d-mers starting in the segment
+            const size_t span = TURBOSQUEEZE_TRAIN_SEGMENT - TURBOSQUEEZE_TRAIN_DMER + 1;
+            uint64_t score = 0, best = 0;
+            size_t bestPos = 0;
+
+            for (size_t q=0; q<epochSize; q++)
+            {
+                if (dmers[q]) score += counts[dmers[q]-1];
+                if (q >= span && dmers[q-span]) score -= counts[dmers[q-span]-1];
+
+                if (q+1 >= span && q+1-span+TURBOSQUEEZE_TRAIN_SEGMENT <= epochSize && score > best)
+                {
+                    best = score;
+                    bestPos = q+1-span;
+                }
+            }
+
+            if (best == 0) continue;
+
+            for (size_t q=bestPos; q<bestPos+span; q++)
+                if (dmers[q]) counts[dmers[q]-1] = 0;
+
+            segments.push_back( std::make_pair( best, first+bestPos ) );
+        }
+
+        // The best segments go last, closest to the blocks
+        std::stable_sort( segments.begin(), segments.end(), []( const std::pair<uint64_t,size_t> &a, const std::pair<uint64_t,size_t> &b ) { return a.first < b.first; } );
+
+        size_t size = 0;
+
+        for (auto &segment : segments)
+        {
+            memcpy( dict+size, samples+segment.second, TURBOSQUEEZE_TRAIN_SEGMENT );
+            size += TURBOSQUEEZE_TRAIN_SEGMENT;
+        }
+
+        delete [] ends;
+        delete [] seen;
+        delete [] counts;
+
+        return size;
+    }
+
+}
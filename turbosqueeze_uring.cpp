@@ -0,0 +1,574 @@
+/*
+Libturbosqueeze TurboSqueeze io_uring reader and writer.
+
+BSD 3-Clause License
+
+Copyright (c) 2024, Julien Perrier-cornet
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include "turbosqueeze.h"
+
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+#define align_alloc( A, B ) aligned_alloc( A, B )
+#define align_free( A ) free( A )
+
+
+// Largest compressed block, for any block size
+#define TURBOSQUEEZE_MAX_OUTPUT_SZ ((1u<<MAX_BLOCK_BITS) + (1u<<(MAX_BLOCK_BITS-2)))
+
+// Requests in flight and their size, chunks are aligned for O_DIRECT
+#define TURBOSQUEEZE_URING_DEPTH (8)
+#define TURBOSQUEEZE_URING_CHUNK (1<<20)
+#define TURBOSQUEEZE_DIRECT_ALIGN (4096)
+#define TURBOSQUEEZE_WRITE_CHUNK_SZ (TURBOSQUEEZE_URING_CHUNK + ((TURBOSQUEEZE_MAX_OUTPUT_SZ + TURBOSQUEEZE_DIRECT_ALIGN - 1) & ~(TURBOSQUEEZE_DIRECT_ALIGN - 1)))
+
+
+namespace TurboSqueeze {
+
+
+    // Minimal io_uring over the raw system calls, completions carry the chunk index.
+    // When the kernel refuses io_uring or its read and write opcodes, the requests are served synchronously with pread/pwrite.
+    struct Uring {
+        int fd;
+        uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+        uint32_t *cqHead, *cqTail, *cqMask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sqRing, *cqRing;
+        size_t sqRingSize, cqRingSize, sqesSize;
+        uint32_t inFlight;
+        // Synchronous fallback completions
+        uint64_t doneTag[TURBOSQUEEZE_URING_DEPTH];
+        int32_t doneRes[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t doneHead;
+    };
+
+    // IORING_OP_READ and IORING_OP_WRITE came with Linux 5.6, older rings fail them with -EINVAL
+    static bool uringProbe( int fd )
+    {
+        size_t size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = (struct io_uring_probe*) calloc( 1, size );
+        if (!probe) return false;
+
+        bool supported = syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256 ) >= 0 && probe->last_op >= IORING_OP_WRITE &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+        free( probe );
+        return supported;
+    }
+
+    static void uringSetup( Uring &ring, uint32_t entries )
+    {
+        memset( &ring, 0, sizeof(Uring) );
+        ring.fd = -1;
+
+        struct io_uring_params params;
+        memset( &params, 0, sizeof(params) );
+
+        int fd = (int) syscall( __NR_io_uring_setup, entries, &params );
+        if (fd < 0) return;
+
+        if (!uringProbe( fd )) { close( fd ); return; }
+
+        ring.sqRingSize = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+        ring.cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+        ring.sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single && ring.cqRingSize > ring.sqRingSize) ring.sqRingSize = ring.cqRingSize;
+
+        ring.sqRing = mmap( nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+        ring.cqRing = single ? ring.sqRing : mmap( nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+        ring.sqes = (struct io_uring_sqe*) mmap( nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+
+        if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED)
+        {
+            if (ring.sqRing != MAP_FAILED) munmap( ring.sqRing, ring.sqRingSize );
+            if (!single && ring.cqRing != MAP_FAILED) munmap( ring.cqRing, ring.cqRingSize );
+            if (ring.sqes != MAP_FAILED) munmap( ring.sqes, ring.sqesSize );
+            close( fd );
+            return;
+        }
+
+        uint8_t *sq = (uint8_t*) ring.sqRing;
+        uint8_t *cq = (uint8_t*) ring.cqRing;
+
+        ring.sqHead = (uint32_t*) (sq + params.sq_off.head);
+        ring.sqTail = (uint32_t*) (sq + params.sq_off.tail);
+        ring.sqMask = (uint32_t*) (sq + params.sq_off.ring_mask);
+        ring.sqArray = (uint32_t*) (sq + params.sq_off.array);
+        ring.cqHead = (uint32_t*) (cq + params.cq_off.head);
+        ring.cqTail = (uint32_t*) (cq + params.cq_off.tail);
+        ring.cqMask = (uint32_t*) (cq + params.cq_off.ring_mask);
+        ring.cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+        ring.fd = fd;
+    }
+
+    static void uringTeardown( Uring &ring )
+    {
+        if (ring.fd < 0) return;
+
+        munmap( ring.sqes, ring.sqesSize );
+        if (ring.cqRing != ring.sqRing) munmap( ring.cqRing, ring.cqRingSize );
+        munmap( ring.sqRing, ring.sqRingSize );
+        close( ring.fd );
+        ring.fd = -1;
+    }
+
+    // False when the request could not be queued, it then has no completion
+    static bool uringSubmit( Uring &ring, int fd, uint8_t opcode, uint8_t *buffer, uint32_t length, uint64_t offset, uint64_t tag )
+    {
+        if (ring.fd < 0)
+        {
+            ssize_t done = 0;
+
+            while (done < length)
+            {
+                ssize_t res = opcode == IORING_OP_READ ? pread( fd, buffer+done, length-done, offset+done ) : pwrite( fd, buffer+done, length-done, offset+done );
+                if (res < 0 && errno == EINTR) continue;
+                if (res <= 0) { if (done == 0) done = res < 0 ? -errno : 0; break; }
+                done += res;
+            }
+
+            uint32_t k = (ring.doneHead + ring.inFlight) % TURBOSQUEEZE_URING_DEPTH;
+            ring.doneTag[k] = tag;
+            ring.doneRes[k] = (int32_t) done;
+            ring.inFlight++;
+            return true;
+        }
+
+        uint32_t tail = *ring.sqTail;
+        uint32_t index = tail & *ring.sqMask;
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+
+        memset( sqe, 0, sizeof(struct io_uring_sqe) );
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) buffer;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = tag;
+
+        ring.sqArray[index] = index;
+        __atomic_store_n( ring.sqTail, tail+1, __ATOMIC_RELEASE );
+
+        long submitted;
+        while ((submitted = syscall( __NR_io_uring_enter, ring.fd, 1, 0, 0, nullptr, 0 )) < 0 && errno == EINTR) ;
+
+        // The kernel did not take the entry, withdraw it
+        if (submitted < 1)
+        {
+            __atomic_store_n( ring.sqTail, tail, __ATOMIC_RELEASE );
+            return false;
+        }
+
+        ring.inFlight++;
+        return true;
+    }
+
+    // Next completion, false when nothing is in flight
+    static bool uringWait( Uring &ring, uint64_t *tag, int32_t *res )
+    {
+        if (ring.inFlight == 0) return false;
+
+        if (ring.fd < 0)
+        {
+            *tag = ring.doneTag[ring.doneHead];
+            *res = ring.doneRes[ring.doneHead];
+            ring.doneHead = (ring.doneHead + 1) % TURBOSQUEEZE_URING_DEPTH;
+            ring.inFlight--;
+            return true;
+        }
+
+        while (true)
+        {
+            uint32_t head = *ring.cqHead;
+
+            if (head != __atomic_load_n( ring.cqTail, __ATOMIC_ACQUIRE ))
+            {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+
+                *tag = cqe->user_data;
+                *res = cqe->res;
+
+                __atomic_store_n( ring.cqHead, head+1, __ATOMIC_RELEASE );
+                ring.inFlight--;
+                return true;
+            }
+
+            if (syscall( __NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 ) < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+    // Opens with O_DIRECT when asked and supported by the file system
+    static int openFile( const char *filename, int flags, bool *direct )
+    {
+        int fd = -1;
+
+        if (*direct)
+        {
+            fd = ::open( filename, flags | O_DIRECT, 0644 );
+            if (fd < 0) *direct = false;
+        }
+
+        if (fd < 0) fd = ::open( filename, flags, 0644 );
+
+        return fd;
+    }
+
+
+    struct UringReaderContext {
+        Uring ring;
+        int fd;
+        uint64_t nextOffset;
+        uint8_t *chunks[TURBOSQUEEZE_URING_DEPTH];
+        uint64_t chunkOffset[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t chunkLength[TURBOSQUEEZE_URING_DEPTH];
+        bool pending[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t head;
+        uint32_t count;
+        uint8_t *bounce;
+    };
+
+    // Completion of a chunk read, partial reads are resubmitted for the rest of the chunk. False on an I/O error,
+    // or when the file ends before the size it had when opened.
+    static bool readCompleted( UringReaderContext *ctx, uint64_t tag, int32_t res, uint64_t fileSize )
+    {
+        uint32_t k = (uint32_t) tag;
+
+        if (res < 0 && res != -EINTR && res != -EAGAIN) return false;
+        if (res == 0) return false;
+        if (res > 0) ctx->chunkLength[k] += res;
+
+        uint64_t expected = fileSize - ctx->chunkOffset[k] < TURBOSQUEEZE_URING_CHUNK ? fileSize - ctx->chunkOffset[k] : TURBOSQUEEZE_URING_CHUNK;
+
+        if (ctx->chunkLength[k] >= expected)
+        {
+            ctx->pending[k] = false;
+            return true;
+        }
+
+        uint32_t done = ctx->chunkLength[k];
+        return uringSubmit( ctx->ring, ctx->fd, IORING_OP_READ, ctx->chunks[k] + done, TURBOSQUEEZE_URING_CHUNK - done, ctx->chunkOffset[k] + done, k );
+    }
+
+    // Waits until chunk k is read, false when a read failed
+    static bool readChunk( UringReaderContext *ctx, uint32_t k, uint64_t fileSize )
+    {
+        while (ctx->pending[k])
+        {
+            uint64_t tag; int32_t res;
+            if (!uringWait( ctx->ring, &tag, &res )) return false;
+            if (!readCompleted( ctx, tag, res, fileSize )) return false;
+        }
+
+        return true;
+    }
+
+    UringFileReader* UringFileReaderFactory( const char *filename, bool o_direct )
+    {
+        UringFileReader* reader = new UringFileReader();
+        if (reader) reader->set( filename, o_direct );
+        return reader;
+    }
+
+    void UringFileReader::open()
+    {
+        bool o_direct = direct;
+        int fd = openFile( filename, O_RDONLY, &o_direct );
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat( fd, &st ) != 0) { close( fd ); return; }
+
+        ctx = new UringReaderContext();
+        memset( ctx, 0, sizeof(UringReaderContext) );
+
+        uringSetup( ctx->ring, TURBOSQUEEZE_URING_DEPTH );
+        ctx->fd = fd;
+        fileSize = st.st_size;
+
+        for (uint32_t k=0; k<TURBOSQUEEZE_URING_DEPTH; k++)
+            ctx->chunks[k] = (uint8_t*) align_alloc( TURBOSQUEEZE_DIRECT_ALIGN, TURBOSQUEEZE_URING_CHUNK );
+        ctx->bounce = (uint8_t*) align_alloc( TURBOSQUEEZE_DIRECT_ALIGN, TURBOSQUEEZE_MAX_OUTPUT_SZ );
+    }
+
+    size_t UringFileReader::read(char** buffer, size_t *bufferStart, size_t bufferSize)
+    {
+        *bufferStart = 0;
+
+        if (!ctx && filename) open();
+        filename = nullptr;
+
+        if (!ctx || failed || bufferSize > TURBOSQUEEZE_MAX_OUTPUT_SZ) return 0;
+
+        // Release the chunks consumed by the previous reads
+        while (ctx->count > 0 && ctx->chunkOffset[ctx->head] + TURBOSQUEEZE_URING_CHUNK <= position)
+        {
+            if (!readChunk( ctx, ctx->head, fileSize )) { failed = true; return 0; }
+
+            ctx->head = (ctx->head + 1) % TURBOSQUEEZE_URING_DEPTH;
+            ctx->count--;
+        }
+
+        // Keep every chunk in flight ahead of the reading position
+        while (ctx->count < TURBOSQUEEZE_URING_DEPTH && ctx->nextOffset < fileSize)
+        {
+            uint32_t k = (ctx->head + ctx->count) % TURBOSQUEEZE_URING_DEPTH;
+
+            ctx->chunkOffset[k] = ctx->nextOffset;
+            ctx->chunkLength[k] = 0;
+            ctx->pending[k] = true;
+            if (!uringSubmit( ctx->ring, ctx->fd, IORING_OP_READ, ctx->chunks[k], TURBOSQUEEZE_URING_CHUNK, ctx->nextOffset, k )) { failed = true; return 0; }
+
+            ctx->nextOffset += TURBOSQUEEZE_URING_CHUNK;
+            ctx->count++;
+        }
+
+        size_t remaining = position < fileSize ? fileSize - position : 0;
+        size_t bytesToRead = remaining < bufferSize ? remaining : bufferSize;
+        size_t copied = 0;
+
+        for (uint32_t n=0; n<ctx->count && copied < bytesToRead; n++)
+        {
+            uint32_t k = (ctx->head + n) % TURBOSQUEEZE_URING_DEPTH;
+
+            if (!readChunk( ctx, k, fileSize )) { failed = true; return 0; }
+
+            size_t start = position + copied - ctx->chunkOffset[k];
+            size_t available = ctx->chunkLength[k] > start ? ctx->chunkLength[k] - start : 0;
+            size_t size = bytesToRead - copied < available ? bytesToRead - copied : available;
+
+            // Zero-copy when the request fits in one chunk
+            if (copied == 0 && size == bytesToRead)
+            {
+                *buffer = (char*) ctx->chunks[k];
+                *bufferStart = start;
+                position += bytesToRead;
+                return bytesToRead;
+            }
+
+            memcpy( ctx->bounce + copied, ctx->chunks[k] + start, size );
+            copied += size;
+        }
+
+        *buffer = (char*) ctx->bounce;
+        position += copied;
+
+        return copied;
+    }
+
+    UringFileReader::~UringFileReader()
+    {
+        if (!ctx) return;
+
+        uint64_t tag; int32_t res;
+        while (uringWait( ctx->ring, &tag, &res )) ;
+
+        uringTeardown( ctx->ring );
+        close( ctx->fd );
+
+        for (uint32_t k=0; k<TURBOSQUEEZE_URING_DEPTH; k++)
+            if (ctx->chunks[k]) align_free( ctx->chunks[k] );
+        if (ctx->bounce) align_free( ctx->bounce );
+
+        delete ctx;
+    }
+
+
+    struct UringWriterContext {
+        Uring ring;
+        int fd;
+        bool direct;
+        uint8_t *chunks[TURBOSQUEEZE_URING_DEPTH];
+        uint64_t chunkOffset[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t chunkLength[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t chunkWritten[TURBOSQUEEZE_URING_DEPTH];
+        bool busy[TURBOSQUEEZE_URING_DEPTH];
+        uint32_t current;
+        size_t fill;
+        uint64_t fileOffset;
+    };
+
+    // Writes length bytes of chunk k at offset, false when the request could not be queued
+    static bool writeChunk( UringWriterContext *ctx, uint32_t k, uint32_t length, uint64_t offset )
+    {
+        ctx->chunkOffset[k] = offset;
+        ctx->chunkLength[k] = length;
+        ctx->chunkWritten[k] = 0;
+
+        ctx->busy[k] = uringSubmit( ctx->ring, ctx->fd, IORING_OP_WRITE, ctx->chunks[k], length, offset, k );
+        return ctx->busy[k];
+    }
+
+    // Completion of a chunk write, short writes are resubmitted for the rest of the chunk. False on an I/O error.
+    static bool writeCompleted( UringWriterContext *ctx, uint64_t tag, int32_t res )
+    {
+        uint32_t k = (uint32_t) tag;
+
+        ctx->busy[k] = false;
+
+        if (res < 0 && res != -EINTR && res != -EAGAIN) return false;
+        if (res == 0) return false;
+        if (res > 0) ctx->chunkWritten[k] += res;
+
+        if (ctx->chunkWritten[k] >= ctx->chunkLength[k]) return true;
+
+        uint32_t done = ctx->chunkWritten[k];
+        ctx->busy[k] = uringSubmit( ctx->ring, ctx->fd, IORING_OP_WRITE, ctx->chunks[k] + done, ctx->chunkLength[k] - done, ctx->chunkOffset[k] + done, k );
+        return ctx->busy[k];
+    }
+
+    UringFileWriter* UringFileWriterFactory( const char *filename, bool o_direct )
+    {
+        UringFileWriter* writer = new UringFileWriter();
+        if (writer) writer->set( filename, o_direct );
+        return writer;
+    }
+
+    void UringFileWriter::open()
+    {
+        bool o_direct = direct;
+        int fd = openFile( filename, O_WRONLY | O_CREAT | O_TRUNC, &o_direct );
+        if (fd < 0) return;
+
+        ctx = new UringWriterContext();
+        memset( ctx, 0, sizeof(UringWriterContext) );
+
+        uringSetup( ctx->ring, TURBOSQUEEZE_URING_DEPTH );
+        ctx->fd = fd;
+        ctx->direct = o_direct;
+
+        for (uint32_t k=0; k<TURBOSQUEEZE_URING_DEPTH; k++)
+            ctx->chunks[k] = (uint8_t*) align_alloc( TURBOSQUEEZE_DIRECT_ALIGN, TURBOSQUEEZE_WRITE_CHUNK_SZ );
+    }
+
+    // The destination is the free end of the current chunk, so blocks are encoded in place
+    void UringFileWriter::getdest(char** data, size_t size)
+    {
+        *data = nullptr;
+
+        if (!ctx && filename) open();
+        filename = nullptr;
+
+        // Nothing more is taken after a failed write
+        if (ctx && !failed && size <= TURBOSQUEEZE_MAX_OUTPUT_SZ && ctx->chunks[ctx->current])
+            *data = (char*) ctx->chunks[ctx->current] + ctx->fill;
+    }
+
+    void UringFileWriter::write( size_t dataSize )
+    {
+        if (!ctx || failed) return;
+
+        ctx->fill += dataSize;
+        position += dataSize;
+
+        if (ctx->fill < TURBOSQUEEZE_URING_CHUNK) return;
+
+        // A full chunk goes to the ring, the bytes past its end move to the next free chunk
+        uint32_t k = ctx->current;
+        uint32_t next = (k + 1) % TURBOSQUEEZE_URING_DEPTH;
+
+        if (!writeChunk( ctx, k, TURBOSQUEEZE_URING_CHUNK, ctx->fileOffset )) failed = true;
+
+        while (!failed && ctx->busy[next])
+        {
+            uint64_t tag; int32_t res;
+            if (!uringWait( ctx->ring, &tag, &res ) || !writeCompleted( ctx, tag, res )) failed = true;
+        }
+
+        // The next chunk may still be in a kernel write after a failure, the bytes left over are dropped
+        if (failed)
+        {
+            ctx->fill = 0;
+            return;
+        }
+
+        ctx->fill -= TURBOSQUEEZE_URING_CHUNK;
+        memcpy( ctx->chunks[next], ctx->chunks[k] + TURBOSQUEEZE_URING_CHUNK, ctx->fill );
+
+        ctx->fileOffset += TURBOSQUEEZE_URING_CHUNK;
+        ctx->current = next;
+    }
+
+    void UringFileWriter::close()
+    {
+        if (!ctx) return;
+
+        // Last partial chunk, padded to the direct I/O alignment then cut back
+        if (ctx->fill > 0)
+        {
+            size_t length = ctx->direct ? (ctx->fill + TURBOSQUEEZE_DIRECT_ALIGN - 1) & ~((size_t) TURBOSQUEEZE_DIRECT_ALIGN - 1) : ctx->fill;
+
+            memset( ctx->chunks[ctx->current] + ctx->fill, 0, length - ctx->fill );
+            if (!writeChunk( ctx, ctx->current, (uint32_t) length, ctx->fileOffset )) failed = true;
+        }
+
+        uint64_t tag; int32_t res;
+        while (uringWait( ctx->ring, &tag, &res ))
+            if (!writeCompleted( ctx, tag, res )) failed = true;
+
+        if (ctx->direct && ftruncate( ctx->fd, position ) != 0) failed = true;
+
+        uringTeardown( ctx->ring );
+        if (::close( ctx->fd ) != 0) failed = true;
+
+        for (uint32_t k=0; k<TURBOSQUEEZE_URING_DEPTH; k++)
+            if (ctx->chunks[k]) align_free( ctx->chunks[k] );
+
+        delete ctx;
+        ctx = nullptr;
+    }
+
+    UringFileWriter::~UringFileWriter()
+    {
+        close();
+    }
+
+
+}
+
+#endif